@@ -7,6 +7,18 @@
 //============================================================================
 
 #include "Dip1.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+// window size of dark channel and guided filter, regularization of guided filter
+static const int DEHAZE_WINDOW = 15;
+static const double DEHAZE_EPS = 0.001;
 
 // function that performs some kind of (simple) image processing
 /*
@@ -14,21 +26,176 @@ img	input image
 return	output image
 */
 Mat Dip1::doSomethingThatMyTutorIsGonnaLike(const Mat &img)
+{
+	DehazeContext context;
+	dehazeTiled(img, context);
+	return context.output;
+}
+
+// defogging based on dark channel, all intermediate images are kept in the given context
+/*
+img		input image (CV_8UC3)
+context	buffers and atmospheric light of the stream, result in context.output
+*/
+void Dip1::dehaze(const Mat &img, DehazeContext &context)
 {
 	//Implement defogging based on dark channel
 	//Reference: He, Kaiming, Jian Sun, and Xiaoou Tang. "Single image haze removal using dark channel prior." IEEE transactions on pattern analysis and machine intelligence 33.12 (2011): 2341-2353.
 	//Reference: http://coderskychen.cn/2015/12/11/%E6%9A%97%E9%80%9A%E9%81%93%E5%8E%BB%E9%9B%BE%E7%AE%97%E6%B3%95%E7%9A%84C-%E5%AE%9E%E7%8E%B0%E4%B8%8E%E4%BC%98%E5%8C%96%EF%BC%88%E4%B8%80%EF%BC%89/
 	//Step 1: compute the dark channel of the original image
+	darkChannel(img, context.dark);
+
+	//Step 1-1: minimum filter
+	//Reference: van Herk, Marcel. "A fast algorithm for local minimum and maximum filters on rectangular and octagonal kernels." Pattern Recognition Letters 13.7 (1992): 517-521.
+	minFilterVertical(context.dark, context.buffer, DEHAZE_WINDOW);
+	transpose(context.buffer, context.transposed);
+	minFilterVertical(context.transposed, context.bufferTransposed, DEHAZE_WINDOW);
+	transpose(context.bufferTransposed, context.dark);
+
+	//imwrite("dark_channel.jpg", context.dark);
+
+	//Step 2: computer the atmospheric light A
+	cvtColor(img, context.gray, CV_BGR2GRAY);
+	updateAtmosphericLight(img, context);
+
+	//Step 3: computer transmission t(X)
+	transmissionMap(context.dark, context.A, context.transmission);
+	normalizeGray(context.gray, context.guide);
+
+	//Step 3-1: guided image filtering (better than softmatting)
+	//Reference: He, Kaiming, Jian Sun, and Xiaoou Tang. "Guided image filtering." European conference on computer vision. Springer, Berlin, Heidelberg, 2010.
+	//Reference: https://blog.csdn.net/pi9nc/article/details/26592377
+	guidedFilter(context.guide, context.transmission, context.refined, DEHAZE_WINDOW / 2, DEHAZE_EPS, 1, &context.guided);
+
+	//Step 4: compute the scene radiance J(X)
+	recoverRadiance(img, context.refined, context.A, context.output);
+}
+
+// part of a tile buffer, the buffer is allocated once for the largest tile and kept for the smaller ones
+/*
+buffer	buffer of a worker
+side	side of the largest (square) tile with its halo
+size	size of the current tile with its halo
+type	type of the buffer
+return	top left part of the buffer of the given size
+*/
+static Mat tileBuffer(Mat &buffer, int side, Size size, int type)
+{
+	buffer.create(side, side, type);
+	return buffer(Rect(0, 0, size.width, size.height));
+}
+
+// defogging based on dark channel, processed in tiles on all threads
+// every tile runs all steps while it is in cache, the result is identical to Dip1::dehaze(..)
+// every thread works on a contiguous range of tiles with its own buffers, so memory depends on the number of threads
+// and the tile size, not on the image size
+/*
+img		input image (CV_8UC3)
+context	buffers and atmospheric light of the stream, result in context.output
+tileSize	size of the (square) tiles
+*/
+void Dip1::dehazeTiled(const Mat &img, DehazeContext &context, int tileSize)
+{
+	int rows = img.rows;
+	int cols = img.cols;
+	int tilesX = (cols + tileSize - 1) / tileSize;
+	int tilesY = (rows + tileSize - 1) / tileSize;
+	int tiles = tilesX * tilesY;
+	Rect frame(0, 0, cols, rows);
+	context.dark.create(rows, cols, CV_8UC1);
+	context.gray.create(rows, cols, CV_8UC1);
+	context.output.create(rows, cols, CV_8UC3);
+	// one stripe of tiles per thread, every stripe has its own buffers
+	int stripes = std::min(std::max(getNumThreads(), 1), tiles);
+	if ((int)context.tiles.size() != stripes)
+		context.tiles.resize(stripes);
+
+	// dark channel with minimum filter and gray image of each tile
+	// halo: radius of the minimum filter
+	parallel_for_(Range(0, stripes), [&](const Range &range) {
+		int halo = DEHAZE_WINDOW / 2;
+		int side = tileSize + 2 * halo;
+		for (int s = range.start; s < range.end; s++)
+		{
+			DehazeTile &buffers = context.tiles[s];
+			for (int n = tiles * s / stripes; n < tiles * (s + 1) / stripes; n++)
+			{
+				Rect tile(n % tilesX * tileSize, n / tilesX * tileSize, tileSize, tileSize);
+				tile = tile & frame;
+				Rect region(tile.x - halo, tile.y - halo, tile.width + 2 * halo, tile.height + 2 * halo);
+				region = region & frame;
+				Rect inner(tile.x - region.x, tile.y - region.y, tile.width, tile.height);
+				Size transposedSize(region.height, region.width);
+				Mat dark = tileBuffer(buffers.dark, side, region.size(), CV_8UC1);
+				Mat buffer = tileBuffer(buffers.buffer, side, region.size(), CV_8UC1);
+				Mat transposed = tileBuffer(buffers.transposed, side, transposedSize, CV_8UC1);
+				Mat bufferTransposed = tileBuffer(buffers.bufferTransposed, side, transposedSize, CV_8UC1);
+				Mat gray = tileBuffer(buffers.gray, side, tile.size(), CV_8UC1);
+
+				darkChannel(img(region), dark);
+				minFilterVertical(dark, buffer, DEHAZE_WINDOW);
+				transpose(buffer, transposed);
+				minFilterVertical(transposed, bufferTransposed, DEHAZE_WINDOW);
+				transpose(bufferTransposed, dark);
+				dark(inner).copyTo(context.dark(tile));
+
+				Mat grayTile = context.gray(tile);
+				cvtColor(img(tile), gray, CV_BGR2GRAY);
+				gray.copyTo(grayTile);
+			}
+		}
+	}, stripes);
+
+	// the atmospheric light depends on the whole dark channel
+	updateAtmosphericLight(img, context);
+
+	// transmission, guided filter and scene radiance of each tile
+	// halo: both box filters of the guided filter
+	parallel_for_(Range(0, stripes), [&](const Range &range) {
+		int r = DEHAZE_WINDOW / 2;
+		int side = tileSize + 4 * r;
+		for (int s = range.start; s < range.end; s++)
+		{
+			DehazeTile &buffers = context.tiles[s];
+			for (int n = tiles * s / stripes; n < tiles * (s + 1) / stripes; n++)
+			{
+				Rect tile(n % tilesX * tileSize, n / tilesX * tileSize, tileSize, tileSize);
+				tile = tile & frame;
+				Rect region(tile.x - 2 * r, tile.y - 2 * r, tile.width + 4 * r, tile.height + 4 * r);
+				region = region & frame;
+				Rect inner(tile.x - region.x, tile.y - region.y, tile.width, tile.height);
+				Mat transmission = tileBuffer(buffers.transmission, side, region.size(), CV_32FC1);
+				Mat guide = tileBuffer(buffers.guide, side, region.size(), CV_32FC1);
+				Mat refined = tileBuffer(buffers.refined, side, region.size(), CV_32FC1);
+
+				transmissionMap(context.dark(region), context.A, transmission);
+				normalizeGray(context.gray(region), guide);
+				guidedFilter(guide, transmission, refined, r, DEHAZE_EPS, 1, &buffers.guided);
+
+				Mat outputTile = context.output(tile);
+				recoverRadiance(img(tile), refined(inner), context.A, outputTile);
+			}
+		}
+	}, stripes);
+}
+
+// dark channel: minimum over the color channels
+/*
+img	input image (CV_8UC3)
+dst	output image (CV_8UC1)
+*/
+void Dip1::darkChannel(const Mat &img, Mat &dst)
+{
 	int min = 255;
-	Mat dark_channel_img(img.rows, img.cols, CV_8UC1);
 	int rows = img.rows;
 	int cols = img.cols;
 	int b, g, r;
+	dst.create(rows, cols, CV_8UC1);
 
 	for (int i = 0; i < rows; i++)
 	{
 		const uchar *inData = img.ptr<uchar>(i);
-		uchar *outData = dark_channel_img.ptr<uchar>(i);
+		uchar *outData = dst.ptr<uchar>(i);
 		for (int j = 0; j < cols; j++)
 		{
 			b = *inData++;
@@ -41,145 +208,139 @@ Mat Dip1::doSomethingThatMyTutorIsGonnaLike(const Mat &img)
 			min = 255;
 		}
 	}
+}
 
-	//Step 1-1: minimum filter
-	//Reference: https://blog.csdn.net/cgqzu/article/details/79888115?utm_source=blogxgwz1
-	int windowsize = 15;
-	r = (windowsize - 1) / 2; //radius
-	Mat dst_ex;
-	copyMakeBorder(dark_channel_img, dst_ex, r, r, r, r, BORDER_CONSTANT, Scalar(255));
-
-	for (int i = r; i < dst_ex.rows - r; i++)
-	{
-		for (int j = r; j < dst_ex.cols - r; j++)
-		{
-			int minVal = dst_ex.at<uchar>(i, j);
-			for (int s = -r; s < r + 1; s++)
-			{
-				for (int t = -r; t < r + 1; t++)
-				{
-					if (dst_ex.at<uchar>(i + s, j + t) < minVal)
-					{
-						minVal = dst_ex.at<uchar>(i + s, j + t);
-					}
-				}
-			}
-			dark_channel_img.at<uchar>(i - r, j - r) = minVal;
-		}
-	}
-
-	//imwrite("dark_channel.jpg", dark_channel_img);
-
-	//Step 2: computer the atmospheric light A
-	int darksize = rows * cols;
-	int topsize = darksize / 1000;
-	int *A = new int[3];
-	int sum[3] = {0, 0, 0};
-	typedef struct Pixel
-	{
-		int x;
-		int y;
-		int value;
-	} Pixel;
-	Pixel *toppixels, *allpixels;
-	toppixels = new Pixel[topsize];
-	allpixels = new Pixel[darksize];
-
-	for (int i = 0; i < rows; i++)
-	{
-		const uchar *outData = dark_channel_img.ptr<uchar>(i);
-		for (int j = 0; j < cols; j++)
-		{
-			allpixels[i * cols + j].value = *outData++;
-			allpixels[i * cols + j].x = i;
-			allpixels[i * cols + j].y = j;
-		}
-	}
-	std::sort(allpixels, allpixels + darksize, [](const Pixel &a, const Pixel &b) { return a.value > b.value; });
-
-	memcpy(toppixels, allpixels, (topsize) * sizeof(Pixel)); //Finding out the lightest 1000 pixels
-	int val0, val1, val2, avg, max = 0, maxi, maxj, x, y;
-	for (int i = 0; i < topsize; i++)
-	{
-		x = allpixels[i].x;
-		y = allpixels[i].y;
-		const uchar *outData = img.ptr<uchar>(x);
-		outData += 3 * y;
-		val0 = *outData++;
-		val1 = *outData++;
-		val2 = *outData++;
-		avg = (val0 + val1 + val2) / 3;
-		if (max < avg)
-		{
-			max = avg;
-			maxi = x;
-			maxj = y;
-		}
-	}
-	for (int i = 0; i < 3; i++)
+// estimates the atmospheric light of the context from the (filtered) dark channel and the gray image
+// only every updateInterval frames or after a scene change, with exponential smoothing
+/*
+img		input image (CV_8UC3)
+context	stream context with dark channel and gray image of the current frame
+*/
+void Dip1::updateAtmosphericLight(const Mat &img, DehazeContext &context)
+{
+	resize(context.gray, context.thumbnail, Size(64, 36), 0, 0, INTER_AREA);
+	bool sceneChange = context.frames == 0 || norm(context.thumbnail, context.reference, NORM_L1) / (64 * 36) > context.sceneThreshold;
+	if (sceneChange || context.frames % std::max(context.updateInterval, 1) == 0)
 	{
-		A[i] = img.at<Vec3b>(maxi, maxj)[i];
-		//A[i]=img.at<Vec4b>(maxi,maxj)[i];
-		//A[i]=A[i]>220?220:A[i];
+		int A_new[3];
+		atmosphericLight(img, context.dark, A_new);
+		float alpha = sceneChange ? 1 : context.smoothing;
+		for (int i = 0; i < 3; i++)
+			context.A[i] = (1 - alpha) * context.A[i] + alpha * A_new[i];
+		context.thumbnail.copyTo(context.reference);
 	}
+	context.frames++;
+}
 
-	//Step 3: computer transmission t(X)
+// transmission estimated from the dark channel
+/*
+dark	dark channel (CV_8UC1)
+A	atmospheric light (B, G, R)
+dst	output: transmission (CV_32FC1)
+*/
+void Dip1::transmissionMap(const Mat &dark, const float *A, Mat &dst)
+{
 	float avg_A = (A[0] + A[1] + A[2]) / 3.0;
 	float w = 0.95;
-	Mat transmission(rows, cols, CV_32FC1);
+	dst.create(dark.rows, dark.cols, CV_32FC1);
 
-	for (int k = 0; k < rows; k++)
+	for (int k = 0; k < dark.rows; k++)
 	{
-		const uchar *inData = dark_channel_img.ptr<uchar>(k);
-		for (int l = 0; l < cols; l++)
+		const uchar *inData = dark.ptr<uchar>(k);
+		float *outData = dst.ptr<float>(k);
+		for (int l = 0; l < dark.cols; l++)
 		{
-			transmission.at<float>(k, l) = 1 - w * (*inData++ / avg_A);
+			*outData++ = 1 - w * (*inData++ / avg_A);
 		}
 	}
+}
 
-	Mat trans(rows, cols, CV_32FC1);
-	Mat graymat(rows, cols, CV_8UC1);
-	Mat graymat_normalization(rows, cols, CV_32FC1);
-	cvtColor(img, graymat, CV_BGR2GRAY);
-	for (int i = 0; i < rows; i++)
+// gray image scaled to [0, 1], used as guidance image
+/*
+gray	gray image (CV_8UC1)
+dst	output image (CV_32FC1)
+*/
+void Dip1::normalizeGray(const Mat &gray, Mat &dst)
+{
+	dst.create(gray.rows, gray.cols, CV_32FC1);
+	for (int i = 0; i < gray.rows; i++)
 	{
-		const uchar *inData = graymat.ptr<uchar>(i);
-		for (int j = 0; j < cols; j++)
-			graymat_normalization.at<float>(i, j) = *inData++ / 255.0;
+		const uchar *inData = gray.ptr<uchar>(i);
+		float *outData = dst.ptr<float>(i);
+		for (int j = 0; j < gray.cols; j++)
+			*outData++ = *inData++ / 255.0;
 	}
-	//Step 3-1: guided image filtering (better than softmatting)
-	//Reference: He, Kaiming, Jian Sun, and Xiaoou Tang. "Guided image filtering." European conference on computer vision. Springer, Berlin, Heidelberg, 2010.
-	//Reference: https://blog.csdn.net/pi9nc/article/details/26592377
-	Mat mat_Ip, mat_I2;
-	multiply(graymat_normalization, transmission, mat_Ip);
-	multiply(graymat_normalization, graymat_normalization, mat_I2);
-
-	Mat mean_p, mean_I, mean_Ip, mean_I2;
-	Size win_size(2 * r + 1, 2 * r + 1);
-	boxFilter(transmission, mean_p, CV_32F, win_size);
-	boxFilter(graymat_normalization, mean_I, CV_32F, win_size);
-	boxFilter(mat_Ip, mean_Ip, CV_32F, win_size);
-	boxFilter(mat_I2, mean_I2, CV_32F, win_size);
+}
 
-	Mat cov_Ip = mean_Ip - mean_I.mul(mean_p);
-	Mat var_I = mean_I2 - mean_I.mul(mean_I);
-	var_I += 0.001;
+// lower bound t0 of the transmission and number of steps of the reciprocal table over [t0, 1]
+static const float RADIANCE_T0 = 0.1;
+static const int RADIANCE_LEVELS = 8192;
 
-	Mat a_i, b_i;
-	divide(cov_Ip, var_I, a_i);
-	b_i = mean_p - a_i.mul(mean_I);
+// reciprocals 1 / t of the transmissions t0 + (1 - t0) * k / levels, k = 0..levels
+// built once on first use and shared by all calls and threads
+static const vector<float> &reciprocalTable(void)
+{
+	static const vector<float> table = [] {
+		vector<float> reciprocal(RADIANCE_LEVELS + 1);
+		for (int k = 0; k <= RADIANCE_LEVELS; k++)
+			reciprocal[k] = 1 / (RADIANCE_T0 + (1 - RADIANCE_T0) * k / RADIANCE_LEVELS);
+		return reciprocal;
+	}();
+	return table;
+}
 
-	Mat mean_a, mean_b;
-	boxFilter(a_i, mean_a, CV_32F, win_size);
-	boxFilter(b_i, mean_b, CV_32F, win_size);
+// recovers the scene radiance J = (I - A) / max(t, t0) + A in one interleaved pass
+// the reciprocal of t is taken from a table quantized over [t0, 1] (error below 1.5 grey levels),
+// only values t > 1 (overshoot of the guided filter) are divided
+/*
+img	input image (CV_8UC3)
+trans	transmission (CV_32FC1)
+A	atmospheric light (B, G, R)
+dst	output image (CV_8UC3, must not share data with img)
+*/
+void Dip1::recoverRadiance(const Mat &img, const Mat &trans, const float *A, Mat &dst)
+{
+	const int levels = RADIANCE_LEVELS;
+	const float t0 = RADIANCE_T0;
+	const float *reciprocal = &reciprocalTable()[0];
+	float scale = levels / (1 - t0);
 
-	trans = mean_a.mul(graymat_normalization) + mean_b;
+	int rows = img.rows;
+	int cols = img.cols;
+	dst.create(rows, cols, CV_8UC3);
+	for (int i = 0; i < rows; i++)
+	{
+		const float *tData = trans.ptr<float>(i);
+		const uchar *srcData = img.ptr<uchar>(i);
+		uchar *outData = dst.ptr<uchar>(i);
+		for (int j = 0; j < cols; j++, srcData += 3, outData += 3)
+		{
+			int k = cvRound((tData[j] - t0) * scale);
+			float inv = k < 0 ? reciprocal[0] : (k > levels ? 1 / tData[j] : reciprocal[k]);
+			outData[0] = saturate_cast<uchar>((srcData[0] - A[0]) * inv + A[0]);
+			outData[1] = saturate_cast<uchar>((srcData[1] - A[1]) * inv + A[1]);
+			outData[2] = saturate_cast<uchar>((srcData[2] - A[2]) * inv + A[2]);
+		}
+	}
+}
 
-	//Step 4: compute the scene radiance J(X)
-	float t = trans.at<float>(r, r);
+// recovers the scene radiance channel by channel with one division per value, used as reference
+/*
+img	input image (CV_8UC3)
+trans	transmission (CV_32FC1)
+A	atmospheric light (B, G, R)
+return	output image
+*/
+Mat Dip1::recoverRadianceNaive(const Mat &img, const Mat &trans, const float *A)
+{
+	int rows = img.rows;
+	int cols = img.cols;
+	int r = 7;
+	float t;
 	float t0 = 0.1;
 	Mat final_img = Mat::zeros(rows, cols, CV_8UC3);
 	int val = 0;
+	Mat dst_ex;
 	copyMakeBorder(img, dst_ex, r, r, r, r, BORDER_CONSTANT, Scalar(255));
 	for (int i = 0; i < 3; i++)
 	{
@@ -205,6 +366,456 @@ Mat Dip1::doSomethingThatMyTutorIsGonnaLike(const Mat &img)
 	return final_img;
 }
 
+// estimates the atmospheric light from the brightest 0.1% pixels of the dark channel
+// a histogram of the dark channel gives the threshold, so no sorting and no per-pixel allocation is needed
+/*
+img	input image (CV_8UC3)
+dark	dark channel of the input image (CV_8UC1)
+A	output: atmospheric light (B, G, R)
+*/
+void Dip1::atmosphericLight(const Mat &img, const Mat &dark, int *A)
+{
+	int rows = img.rows;
+	int cols = img.cols;
+	int topsize = std::max(rows * cols / 1000, 1);
+	int hist[256] = {0};
+	int i, j;
+
+	for (i = 0; i < rows; i++)
+	{
+		const uchar *darkData = dark.ptr<uchar>(i);
+		for (j = 0; j < cols; j++)
+			hist[*darkData++]++;
+	}
+
+	// all pixels above threshold belong to the brightest pixels,
+	// pixels equal to threshold only until topsize is reached
+	int threshold, above = 0;
+	for (threshold = 255; threshold > 0; threshold--)
+	{
+		if (above + hist[threshold] >= topsize)
+			break;
+		above += hist[threshold];
+	}
+	int quota = topsize - above;
+
+	// among these pixels take the one with largest intensity (ties: larger dark channel value)
+	int avg, max = -1, maxDark = -1, maxi = 0, maxj = 0;
+	for (i = 0; i < rows; i++)
+	{
+		const uchar *darkData = dark.ptr<uchar>(i);
+		const uchar *inData = img.ptr<uchar>(i);
+		for (j = 0; j < cols; j++, inData += 3)
+		{
+			int value = darkData[j];
+			if (value < threshold || (value == threshold && quota-- <= 0))
+				continue;
+			avg = (inData[0] + inData[1] + inData[2]) / 3;
+			if (avg > max || (avg == max && value > maxDark))
+			{
+				max = avg;
+				maxDark = value;
+				maxi = i;
+				maxj = j;
+			}
+		}
+	}
+	for (i = 0; i < 3; i++)
+	{
+		A[i] = img.at<Vec3b>(maxi, maxj)[i];
+	}
+}
+
+// fixed point formats of the running sums in the guided filter
+// integer sums are exact, so sliding the window does not accumulate rounding errors
+static const double GF_INPUT = 1048576.0;   // I and p: 2^20 (products: 2^40)
+static const double GF_COEF = 4294967296.0; // a and b: 2^32
+// largest window sum of either format without overflow (2^62, one bit of headroom)
+static const double GF_MAX_SUM = 4611686018427387904.0;
+
+// whether the window sums of the fixed point guided filter fit into int64
+// I*I and I*p limit |I|, |p| to 2^11 / (2r+1), e.g. 136 at r = 7; a and b are bounded by the inputs and eps
+/*
+maxI	largest absolute value of the guidance image
+maxP	largest absolute value of the filtering input
+r	radius of the window
+eps	regularization
+return	true if the sums of I*I, I*p, a and b fit into int64
+*/
+static bool guidedFilterFixedPoint(double maxI, double maxP, int r, double eps)
+{
+	double area = (2.0 * r + 1) * (2.0 * r + 1);
+	// |cov(I,p)| <= maxI*maxP, so |a| <= maxI*maxP/eps and |b| <= maxP + |a|*maxI
+	double maxA = maxI * maxP / eps;
+	double maxB = maxP + maxA * maxI;
+	return (maxI < 2048.0 && maxP < 2048.0
+		&& area * std::max(maxI, maxP) * std::max(maxI, maxP) * GF_INPUT * GF_INPUT < GF_MAX_SUM
+		&& area * std::max(maxA, maxB) * GF_COEF < GF_MAX_SUM);
+}
+
+// guided image filter based on box filters in double precision
+// used for inputs whose fixed point window sums would overflow
+/*
+I		guidance image (CV_32FC1)
+p		filtering input (CV_32FC1)
+r		radius of the window
+eps		regularization
+dst		output: filtered image (CV_32FC1) or mean coefficients a, b (CV_32FC2)
+coefficients	whether to output the mean coefficients instead of the filtered image
+*/
+static void boxGuidedFilter(const Mat &I, const Mat &p, int r, double eps, Mat &dst, bool coefficients)
+{
+	Size win_size(2 * r + 1, 2 * r + 1);
+	Mat I64, p64, mean_I, mean_p, mean_Ip, mean_II, a, b;
+	I.convertTo(I64, CV_64F);
+	p.convertTo(p64, CV_64F);
+	boxFilter(I64, mean_I, CV_64F, win_size, Point(-1, -1), true, BORDER_REFLECT_101);
+	boxFilter(p64, mean_p, CV_64F, win_size, Point(-1, -1), true, BORDER_REFLECT_101);
+	boxFilter(I64.mul(p64), mean_Ip, CV_64F, win_size, Point(-1, -1), true, BORDER_REFLECT_101);
+	boxFilter(I64.mul(I64), mean_II, CV_64F, win_size, Point(-1, -1), true, BORDER_REFLECT_101);
+	Mat var_I = mean_II - mean_I.mul(mean_I);
+	var_I += eps;
+	divide(mean_Ip - mean_I.mul(mean_p), var_I, a);
+	b = mean_p - a.mul(mean_I);
+	boxFilter(a, a, CV_64F, win_size, Point(-1, -1), true, BORDER_REFLECT_101);
+	boxFilter(b, b, CV_64F, win_size, Point(-1, -1), true, BORDER_REFLECT_101);
+	if (coefficients)
+	{
+		Mat ab[] = {a, b};
+		Mat coef;
+		merge(ab, 2, coef);
+		coef.convertTo(dst, CV_32FC2);
+	}
+	else
+	{
+		Mat q = a.mul(I64) + b;
+		q.convertTo(dst, CV_32FC1);
+	}
+}
+
+// sums a row of column sums over a horizontal window of radius r (border: reflect 101)
+/*
+colSum	column sums
+rowSum	output: window sums
+cols	number of columns
+r	radius of the window
+*/
+static void boxRowSum(const int64 *colSum, int64 *rowSum, int cols, int r)
+{
+	int64 s = 0;
+	for (int d = -r; d <= r; d++)
+		s += colSum[borderInterpolate(d, cols, BORDER_REFLECT_101)];
+	rowSum[0] = s;
+	for (int x = 1; x < cols; x++)
+	{
+		s += colSum[borderInterpolate(x + r, cols, BORDER_REFLECT_101)] - colSum[borderInterpolate(x - r - 1, cols, BORDER_REFLECT_101)];
+		rowSum[x] = s;
+	}
+}
+
+// guided image filter
+//Reference: He, Kaiming, Jian Sun, and Xiaoou Tang. "Guided image filtering." European conference on computer vision. Springer, Berlin, Heidelberg, 2010.
+//Reference: He, Kaiming, and Jian Sun. "Fast guided filter." arXiv preprint arXiv:1505.00996 (2015).
+// exact fixed point sums for |I|, |p| up to 2^11 / (2r+1), i.e. [0,1] for r <= 1000 or up to 255 for r <= 3;
+// larger inputs (or a tiny eps) fall back to box filters in double precision
+/*
+I	guidance image (CV_32FC1)
+p	filtering input (CV_32FC1)
+dst	output image (CV_32FC1)
+r	radius of the window
+eps	regularization
+s	subsampling factor of the fast guided filter (1: exact guided filter)
+buffers	work buffers (e.g. of a DehazeContext), 0: temporary buffers of this call
+*/
+void Dip1::guidedFilter(const Mat &I, const Mat &p, Mat &dst, int r, double eps, int s, GuidedFilterBuffers *buffers)
+{
+	GuidedFilterBuffers temporary;
+	if (!buffers)
+		buffers = &temporary;
+	if (s <= 1)
+	{
+		fusedGuidedFilter(I, p, r, eps, dst, false, *buffers);
+		return;
+	}
+
+	// linear coefficients are computed on the subsampled images and upsampled bilinearly
+	Mat &I_sub = buffers->I_sub, &p_sub = buffers->p_sub, &coef = buffers->coef;
+	Size size_sub((I.cols + s - 1) / s, (I.rows + s - 1) / s);
+	resize(I, I_sub, size_sub, 0, 0, INTER_NEAREST);
+	resize(p, p_sub, size_sub, 0, 0, INTER_NEAREST);
+	fusedGuidedFilter(I_sub, p_sub, std::max(r / s, 1), eps, coef, true, *buffers);
+	resize(coef, coef, I.size(), 0, 0, INTER_LINEAR);
+
+	dst.create(I.size(), CV_32FC1);
+	for (int i = 0; i < I.rows; i++)
+	{
+		const float *IData = I.ptr<float>(i);
+		const float *coefData = coef.ptr<float>(i);
+		float *outData = dst.ptr<float>(i);
+		for (int j = 0; j < I.cols; j++, coefData += 2)
+			*outData++ = coefData[0] * IData[j] + coefData[1];
+	}
+}
+
+// guided image filter computing all window statistics in one sliding window pass
+// only column sums and the last 2r+1 rows of the coefficients a, b are stored
+// inputs outside of the fixed point range (see guidedFilterFixedPoint()) are passed to boxGuidedFilter()
+/*
+I		guidance image (CV_32FC1)
+p		filtering input (CV_32FC1)
+r		radius of the window
+eps		regularization
+dst		output: filtered image (CV_32FC1) or mean coefficients a, b (CV_32FC2)
+coefficients	whether to output the mean coefficients instead of the filtered image
+buffers		work buffers, only reallocated if the image gets wider
+*/
+void Dip1::fusedGuidedFilter(const Mat &I, const Mat &p, int r, double eps, Mat &dst, bool coefficients, GuidedFilterBuffers &buffers)
+{
+	if (!guidedFilterFixedPoint(norm(I, NORM_INF), norm(p, NORM_INF), r, eps))
+	{
+		boxGuidedFilter(I, p, r, eps, dst, coefficients);
+		return;
+	}
+
+	int rows = I.rows;
+	int cols = I.cols;
+	int win = 2 * r + 1;
+	double normInput = 1.0 / ((double)win * win * GF_INPUT);
+	double normProduct = normInput / GF_INPUT;
+	double normCoef = 1.0 / ((double)win * win * GF_COEF);
+	dst.create(rows, cols, coefficients ? CV_32FC2 : CV_32FC1);
+
+	// column sums of I, p, I*p, I*I and of a, b
+	vector<int64> &colI = buffers.colI, &colP = buffers.colP, &colIp = buffers.colIp, &colII = buffers.colII, &colA = buffers.colA, &colB = buffers.colB;
+	vector<int64> &sumI = buffers.sumI, &sumP = buffers.sumP, &sumIp = buffers.sumIp, &sumII = buffers.sumII, &sumA = buffers.sumA, &sumB = buffers.sumB;
+	// a, b of the last 2r+1 rows (row k is stored at k % win)
+	vector<int64> &ringA = buffers.ringA, &ringB = buffers.ringB;
+	// assign() keeps the storage if the size does not grow
+	vector<int64> *columns[] = {&colI, &colP, &colIp, &colII, &colA, &colB};
+	vector<int64> *rowSums[] = {&sumI, &sumP, &sumIp, &sumII, &sumA, &sumB};
+	for (int n = 0; n < 6; n++)
+	{
+		columns[n]->assign(cols, 0);
+		rowSums[n]->resize(cols);
+	}
+	ringA.resize(win * cols);
+	ringB.resize(win * cols);
+
+	// adds (sign = 1) or removes (sign = -1) a row of the input images to the column sums
+	auto updateInput = [&](int y, int sign) {
+		y = borderInterpolate(y, rows, BORDER_REFLECT_101);
+		const float *IData = I.ptr<float>(y);
+		const float *pData = p.ptr<float>(y);
+		for (int x = 0; x < cols; x++)
+		{
+			int64 qI = cvRound(IData[x] * GF_INPUT);
+			int64 qP = cvRound(pData[x] * GF_INPUT);
+			colI[x] += sign * qI;
+			colP[x] += sign * qP;
+			colIp[x] += sign * qI * qP;
+			colII[x] += sign * qI * qI;
+		}
+	};
+	// adds (sign = 1) or removes (sign = -1) a row of the coefficients to the column sums
+	auto updateCoef = [&](int y, int sign) {
+		y = borderInterpolate(y, rows, BORDER_REFLECT_101) % win;
+		const int64 *aData = &ringA[y * cols];
+		const int64 *bData = &ringB[y * cols];
+		for (int x = 0; x < cols; x++)
+		{
+			colA[x] += sign * aData[x];
+			colB[x] += sign * bData[x];
+		}
+	};
+
+	// computes a, b of the next row and moves the input window one row down
+	int k = 0;
+	auto nextCoef = [&]() {
+		boxRowSum(&colI[0], &sumI[0], cols, r);
+		boxRowSum(&colP[0], &sumP[0], cols, r);
+		boxRowSum(&colIp[0], &sumIp[0], cols, r);
+		boxRowSum(&colII[0], &sumII[0], cols, r);
+		int64 *aData = &ringA[(k % win) * cols];
+		int64 *bData = &ringB[(k % win) * cols];
+		for (int x = 0; x < cols; x++)
+		{
+			double mean_I = sumI[x] * normInput;
+			double mean_p = sumP[x] * normInput;
+			double cov_Ip = sumIp[x] * normProduct - mean_I * mean_p;
+			double var_I = sumII[x] * normProduct - mean_I * mean_I;
+			double a = cov_Ip / (var_I + eps);
+			double b = mean_p - a * mean_I;
+			aData[x] = std::llround(a * GF_COEF);
+			bData[x] = std::llround(b * GF_COEF);
+		}
+		k++;
+		if (k < rows)
+		{
+			updateInput(k - r - 1, -1);
+			updateInput(k + r, 1);
+		}
+	};
+
+	for (int d = -r; d <= r; d++)
+		updateInput(d, 1);
+	while (k <= r && k < rows)
+		nextCoef();
+	for (int d = -r; d <= r; d++)
+		updateCoef(d, 1);
+
+	for (int i = 0; i < rows; i++)
+	{
+		boxRowSum(&colA[0], &sumA[0], cols, r);
+		boxRowSum(&colB[0], &sumB[0], cols, r);
+		float *outData = dst.ptr<float>(i);
+		if (coefficients)
+		{
+			for (int j = 0; j < cols; j++)
+			{
+				*outData++ = (float)(sumA[j] * normCoef);
+				*outData++ = (float)(sumB[j] * normCoef);
+			}
+		}
+		else
+		{
+			const float *IData = I.ptr<float>(i);
+			for (int j = 0; j < cols; j++)
+				*outData++ = (float)(sumA[j] * normCoef * IData[j] + sumB[j] * normCoef);
+		}
+
+		if (i + 1 == rows)
+			break;
+		// row i - r leaves the window before its slot in the ring is reused
+		updateCoef(i - r, -1);
+		if (i + r + 1 < rows)
+			nextCoef();
+		updateCoef(i + r + 1, 1);
+	}
+}
+
+// minimum filter with a kSize x kSize window, pixels outside of the image are ignored
+// van Herk/Gil-Werman: about three comparisons per pixel and pass, independent of kSize
+/*
+src	input image (CV_8UC1)
+kSize	window size (odd)
+return	output image
+*/
+Mat Dip1::minFilter(const Mat &src, int kSize)
+{
+	// the horizontal pass is done as vertical pass on the transposed image,
+	// so both passes work on whole rows and can be vectorized
+	Mat tmp, transposed, tmpTransposed, dst;
+	minFilterVertical(src, tmp, kSize);
+	transpose(tmp, transposed);
+	minFilterVertical(transposed, tmpTransposed, kSize);
+	transpose(tmpTransposed, dst);
+	return dst;
+}
+
+// vertical pass of the minimum filter
+/*
+src	input image (CV_8UC1)
+dst	output image (must not share data with src)
+kSize	window size (odd)
+*/
+void Dip1::minFilterVertical(const Mat &src, Mat &dst, int kSize)
+{
+	int r = kSize / 2;
+	int rows = src.rows;
+	int cols = src.cols;
+	dst.create(rows, cols, CV_8UC1);
+	// H: suffix minima of the current block of kSize (padded) rows
+	// G: prefix minima of the following block
+	Mat H(kSize, cols, CV_8UC1);
+	Mat G(kSize, cols, CV_8UC1);
+	vector<uchar> border(cols, 255);
+
+	// padded row p corresponds to row p - r of the source image
+	int i, j, k, p0;
+	for (p0 = 0; p0 < rows; p0 += kSize)
+	{
+		for (k = kSize - 1; k >= 0; k--)
+		{
+			int y = p0 + k - r;
+			const uchar *inData = (y >= 0 && y < rows) ? src.ptr<uchar>(y) : &border[0];
+			uchar *hData = H.ptr<uchar>(k);
+			if (k == kSize - 1)
+			{
+				memcpy(hData, inData, cols);
+				continue;
+			}
+			const uchar *hNext = H.ptr<uchar>(k + 1);
+			for (j = 0; j < cols; j++)
+				hData[j] = std::min(hNext[j], inData[j]);
+		}
+		for (k = 0; k < kSize - 1; k++)
+		{
+			int y = p0 + kSize + k - r;
+			const uchar *inData = (y >= 0 && y < rows) ? src.ptr<uchar>(y) : &border[0];
+			uchar *gData = G.ptr<uchar>(k);
+			if (k == 0)
+			{
+				memcpy(gData, inData, cols);
+				continue;
+			}
+			const uchar *gPrev = G.ptr<uchar>(k - 1);
+			for (j = 0; j < cols; j++)
+				gData[j] = std::min(gPrev[j], inData[j]);
+		}
+
+		// window of output row i covers padded rows i ... i + kSize - 1
+		for (i = p0; i < p0 + kSize && i < rows; i++)
+		{
+			uchar *outData = dst.ptr<uchar>(i);
+			const uchar *hData = H.ptr<uchar>(i - p0);
+			if (i == p0)
+			{
+				memcpy(outData, hData, cols);
+				continue;
+			}
+			const uchar *gData = G.ptr<uchar>(i - p0 - 1);
+			for (j = 0; j < cols; j++)
+				outData[j] = std::min(hData[j], gData[j]);
+		}
+	}
+
+}
+
+// brute force minimum filter with a kSize x kSize window
+/*
+src	input image (CV_8UC1)
+kSize	window size (odd)
+return	output image
+*/
+Mat Dip1::minFilterNaive(const Mat &src, int kSize)
+{
+	//Reference: https://blog.csdn.net/cgqzu/article/details/79888115?utm_source=blogxgwz1
+	int r = (kSize - 1) / 2; //radius
+	Mat dst(src.rows, src.cols, CV_8UC1);
+	Mat dst_ex;
+	copyMakeBorder(src, dst_ex, r, r, r, r, BORDER_CONSTANT, Scalar(255));
+
+	for (int i = r; i < dst_ex.rows - r; i++)
+	{
+		for (int j = r; j < dst_ex.cols - r; j++)
+		{
+			int minVal = dst_ex.at<uchar>(i, j);
+			for (int s = -r; s < r + 1; s++)
+			{
+				for (int t = -r; t < r + 1; t++)
+				{
+					if (dst_ex.at<uchar>(i + s, j + t) < minVal)
+					{
+						minVal = dst_ex.at<uchar>(i + s, j + t);
+					}
+				}
+			}
+			dst.at<uchar>(i - r, j - r) = minVal;
+		}
+	}
+	return dst;
+}
+
 /* *****************************
   GIVEN FUNCTIONS
 ***************************** */
@@ -249,12 +860,233 @@ void Dip1::run(string fname)
 	imshow(win2.c_str(), outputImage);
 
 	// save result
-	imwrite("result.jpg", outputImage);
+	if (!imwrite("result.jpg", outputImage))
+		cout << "ERROR: Cannot write result.jpg" << endl;
 
 	// wait a bit
 	waitKey(0);
 }
 
+// function dehazes a video frame by frame and reports the frame rate
+/*
+fname		path to input video, or index of camera
+outname		path to output video
+updateInterval	number of frames after which the atmospheric light is re-estimated (>= 1)
+*/
+void Dip1::runVideo(string fname, string outname, int updateInterval)
+{
+
+	if (updateInterval < 1)
+	{
+		cout << "ERROR: Update interval must be a positive number of frames" << endl;
+		exit(-1);
+	}
+
+	// open video (or camera)
+	VideoCapture capture;
+	if (fname.find_first_not_of("0123456789") == string::npos)
+		capture.open(atoi(fname.c_str()));
+	else
+		capture.open(fname);
+	if (!capture.isOpened())
+	{
+		cout << "ERROR: Cannot open video " << fname << endl;
+		exit(-1);
+	}
+
+	double fps = capture.get(CAP_PROP_FPS);
+	Size size((int)capture.get(CAP_PROP_FRAME_WIDTH), (int)capture.get(CAP_PROP_FRAME_HEIGHT));
+	VideoWriter writer;
+	writer.open(outname, VideoWriter::fourcc('M', 'J', 'P', 'G'), fps > 0 ? fps : 25, size);
+	if (!writer.isOpened())
+	{
+		cout << "ERROR: Cannot write video " << outname << endl;
+		exit(-1);
+	}
+	cout << "processing " << size.width << "x" << size.height << " video" << endl;
+
+	// buffers are allocated with the first frame and reused afterwards
+	DehazeContext context;
+	context.updateInterval = updateInterval;
+	Mat frame;
+	double timeProcessing = 0;
+	int64 start = getTickCount();
+	while (capture.read(frame))
+	{
+		int64 time = getTickCount();
+		dehazeTiled(frame, context);
+		timeProcessing += (getTickCount() - time) / getTickFrequency();
+		writer.write(context.output);
+
+		if (context.frames % 100 == 0)
+			cout << context.frames << " frames, " << context.frames / timeProcessing << " fps" << endl;
+	}
+	double timeTotal = (getTickCount() - start) / getTickFrequency();
+
+	cout << "done: " << context.frames << " frames" << endl;
+	if (context.frames > 0)
+	{
+		cout << "dehazing: " << context.frames / timeProcessing << " fps" << endl;
+		cout << "including decoding and encoding: " << context.frames / timeTotal << " fps" << endl;
+	}
+}
+
+// whether a file name has the extension of an image format read by imread()
+/*
+file	file name
+return	true for .bmp, .jpg, .jpeg, .png, .tif, .tiff (any case)
+*/
+static bool isImageFile(const string &file)
+{
+	static const char *extensions[] = {"bmp", "jpg", "jpeg", "png", "tif", "tiff"};
+	size_t dot = file.find_last_of('.');
+	if (dot == string::npos || file.find_first_of("/\\", dot) != string::npos)
+		return false;
+	string extension = file.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	for (const char *e : extensions)
+	{
+		if (extension == e)
+			return true;
+	}
+	return false;
+}
+
+// absolute path of a directory without "." or ".." and without a trailing separator
+/*
+dir	directory (relative or absolute)
+return	absolute path, dir itself if it does not exist
+*/
+static string canonicalDirectory(const string &dir)
+{
+#ifdef _WIN32
+	char path[_MAX_PATH];
+	if (_fullpath(path, dir.c_str(), _MAX_PATH))
+		return path;
+#else
+	char path[PATH_MAX];
+	if (realpath(dir.c_str(), path))
+		return path;
+#endif
+	return dir;
+}
+
+// function dehazes all images matching a directory or glob pattern without any window
+// images are processed concurrently, one image (and its buffers) per job at a time
+// processing times are written to "<outdir>/timings.csv"
+// only files with image extensions are processed; outdir must not contain any input image
+/*
+pattern		directory or glob pattern of input images
+outdir		directory for output images, different from the input directories
+jobs		number of images processed at the same time
+*/
+void Dip1::runBatch(string pattern, string outdir, int jobs)
+{
+
+	vector<String> matches, files;
+	glob(pattern, matches);
+	// skips e.g. timings.csv of an earlier run
+	for (size_t n = 0; n < matches.size(); n++)
+	{
+		if (isImageFile(matches[n]))
+			files.push_back(matches[n]);
+	}
+	if (files.empty())
+	{
+		cout << "ERROR: No images found for " << pattern << endl;
+		exit(-1);
+	}
+	// outputs have the names of the inputs, so writing to an input directory would overwrite the originals
+	string outputDir = canonicalDirectory(outdir);
+	for (size_t n = 0; n < files.size(); n++)
+	{
+		size_t slash = files[n].find_last_of("/\\");
+		string inputDir = canonicalDirectory(slash == string::npos ? "." : files[n].substr(0, slash + 1));
+		if (inputDir == outputDir)
+		{
+			cout << "ERROR: Output directory " << outdir << " contains the input image " << files[n] << endl;
+			exit(-1);
+		}
+	}
+	if (jobs <= 0)
+		jobs = std::max(getNumberOfCPUs(), 1);
+
+	// fails if the output directory does not exist or is not writable, before any image is processed
+	fstream file((outdir + "/timings.csv").c_str(), ios::out);
+	if (!file.is_open())
+	{
+		cout << "ERROR: Cannot write to output directory " << outdir << endl;
+		exit(-1);
+	}
+	cout << "processing " << files.size() << " images with " << jobs << " jobs" << endl;
+
+	// every job owns one context, so memory is bounded by jobs * (buffers of largest image)
+	// images are processed serially inside a job, parallelism comes from the jobs
+	vector<string> timings(files.size());
+	std::atomic<int> next(0);
+	std::atomic<int> failed(0);
+	std::mutex outputMutex;
+	auto worker = [&]() {
+		DehazeContext context;
+		for (int n = next++; n < (int)files.size(); n = next++)
+		{
+			string name = files[n].substr(files[n].find_last_of("/\\") + 1);
+			ostringstream line;
+			line << files[n];
+
+			int64 time = getTickCount();
+			Mat inputImage = imread(files[n]);
+			double timeLoad = (getTickCount() - time) * 1000 / getTickFrequency();
+			if (!inputImage.data)
+			{
+				line << ",0,0," << timeLoad << ",,,error";
+				timings[n] = line.str();
+				failed++;
+				std::lock_guard<std::mutex> lock(outputMutex);
+				cout << "ERROR: Cannot read file " << files[n] << endl;
+				continue;
+			}
+
+			// every image is a new scene
+			context.frames = 0;
+			time = getTickCount();
+			dehaze(inputImage, context);
+			double timeDehaze = (getTickCount() - time) * 1000 / getTickFrequency();
+
+			time = getTickCount();
+			bool saved = imwrite(outdir + "/" + name, context.output);
+			double timeSave = (getTickCount() - time) * 1000 / getTickFrequency();
+
+			line << "," << inputImage.cols << "," << inputImage.rows << "," << timeLoad << "," << timeDehaze << "," << timeSave << "," << (saved ? "ok" : "error");
+			timings[n] = line.str();
+			if (!saved)
+				failed++;
+
+			std::lock_guard<std::mutex> lock(outputMutex);
+			if (saved)
+				cout << name << ": " << timeDehaze << "ms" << endl;
+			else
+				cout << "ERROR: Cannot write " << outdir + "/" + name << endl;
+		}
+	};
+	vector<std::thread> threads;
+	for (int k = 0; k < jobs; k++)
+		threads.push_back(std::thread(worker));
+	for (int k = 0; k < jobs; k++)
+		threads[k].join();
+
+	file << "file,width,height,load_ms,dehaze_ms,save_ms,status" << endl;
+	for (size_t n = 0; n < timings.size(); n++)
+		file << timings[n] << endl;
+	file.close();
+	if (failed > 0)
+	{
+		cout << "ERROR: " << failed << " of " << files.size() << " images failed, see " << outdir << "/timings.csv" << endl;
+		exit(-1);
+	}
+	cout << "done" << endl;
+}
+
 // function loads input image and calls the processing functions
 // output is tested on "correctness"
 /*
@@ -282,6 +1114,13 @@ void Dip1::test(string fname)
 	outputImage = doSomethingThatMyTutorIsGonnaLike(inputImage);
 	// test output
 	test_doSomethingThatMyTutorIsGonnaLike(inputImage, outputImage);
+
+	test_minFilter();
+	test_atmosphericLight();
+	test_guidedFilter();
+	test_recoverRadiance();
+	test_dehazeTiled();
+	test_dehazeContext();
 }
 
 // function loads input image and calls processing function
@@ -338,3 +1177,333 @@ void Dip1::test_doSomethingThatMyTutorIsGonnaLike(const Mat &inputImage, const M
 	if (sim >= 0.8)
 		cout << "Warning: The input and output image seem to be quite similar (similarity = " << sim << " ). Are you sure your tutor is gonna like your work?" << endl;
 }
+
+// compares the fast minimum filter with the brute force implementation
+void Dip1::test_minFilter(void)
+{
+
+	Mat input(37, 53, CV_8UC1);
+	randu(input, 0, 256);
+
+	int kSizes[] = {1, 3, 15, 41, 81};
+	for (int k = 0; k < 5; k++)
+	{
+		Mat output = minFilter(input, kSizes[k]);
+		Mat ref = minFilterNaive(input, kSizes[k]);
+		if ((input.cols != output.cols) || (input.rows != output.rows))
+		{
+			cout << "ERROR: Dip1::minFilter(): input.size != output.size" << endl;
+			return;
+		}
+		if (sum(output != ref).val[0] > 0)
+		{
+			cout << "ERROR: Dip1::minFilter(): Result differs from brute force minimum filter (kSize = " << kSizes[k] << ")" << endl;
+			return;
+		}
+	}
+	cout << "Message: Dip1::minFilter() seems to be correct" << endl;
+}
+
+// compares the atmospheric light with the one found by sorting all pixels of the dark channel
+void Dip1::test_atmosphericLight(void)
+{
+
+	Mat img(80, 70, CV_8UC3);
+	Mat dark(80, 70, CV_8UC1);
+	randu(img, 0, 256);
+	randu(dark, 250, 256);
+
+	// reference: sort by dark channel (descending) and take the first topsize pixels
+	int topsize = img.rows * img.cols / 1000;
+	vector<int> index(img.rows * img.cols);
+	for (int i = 0; i < (int)index.size(); i++)
+		index[i] = i;
+	std::stable_sort(index.begin(), index.end(), [&](int a, int b) { return dark.at<uchar>(a / dark.cols, a % dark.cols) > dark.at<uchar>(b / dark.cols, b % dark.cols); });
+	int max = -1, maxIndex = 0;
+	for (int i = 0; i < topsize; i++)
+	{
+		Vec3b pixel = img.at<Vec3b>(index[i] / img.cols, index[i] % img.cols);
+		int avg = (pixel[0] + pixel[1] + pixel[2]) / 3;
+		if (max < avg)
+		{
+			max = avg;
+			maxIndex = index[i];
+		}
+	}
+	Vec3b ref = img.at<Vec3b>(maxIndex / img.cols, maxIndex % img.cols);
+
+	int A[3];
+	atmosphericLight(img, dark, A);
+	if (A[0] != ref[0] || A[1] != ref[1] || A[2] != ref[2])
+	{
+		cout << "ERROR: Dip1::atmosphericLight(): Result differs from sorting based estimation" << endl;
+		return;
+	}
+	cout << "Message: Dip1::atmosphericLight() seems to be correct" << endl;
+}
+
+// compares the fused guided filter with an implementation based on box filters
+void Dip1::test_guidedFilter(void)
+{
+
+	Mat I(45, 38, CV_32FC1);
+	Mat p(45, 38, CV_32FC1);
+	randu(I, 0, 1);
+	randu(p, 0, 1);
+	int r = 7;
+	double eps = 0.001;
+
+	Mat mean_I, mean_p, mean_Ip, mean_II, mean_a, mean_b;
+	Size win_size(2 * r + 1, 2 * r + 1);
+	boxFilter(I, mean_I, CV_32F, win_size);
+	boxFilter(p, mean_p, CV_32F, win_size);
+	boxFilter(I.mul(p), mean_Ip, CV_32F, win_size);
+	boxFilter(I.mul(I), mean_II, CV_32F, win_size);
+	Mat var_I = mean_II - mean_I.mul(mean_I);
+	var_I += eps;
+	Mat a;
+	divide(mean_Ip - mean_I.mul(mean_p), var_I, a);
+	Mat b = mean_p - a.mul(mean_I);
+	boxFilter(a, mean_a, CV_32F, win_size);
+	boxFilter(b, mean_b, CV_32F, win_size);
+	Mat ref = mean_a.mul(I) + mean_b;
+
+	Mat output;
+	guidedFilter(I, p, output, r, eps);
+	if ((I.cols != output.cols) || (I.rows != output.rows))
+	{
+		cout << "ERROR: Dip1::guidedFilter(): input.size != output.size" << endl;
+		return;
+	}
+	if (norm(output, ref, NORM_INF) > 0.0001)
+	{
+		cout << "ERROR: Dip1::guidedFilter(): Result differs from box filter based guided filter" << endl;
+		return;
+	}
+
+	// bright 8-bit range images in [155,255] exceed the fixed point sums
+	// mapping I and p by 100*x + 155 (and eps by 100^2) maps the result alike
+	Mat I255 = I * 100 + 155, p255 = p * 100 + 155;
+	guidedFilter(I255, p255, output, r, eps * 100 * 100);
+	if (norm(output, ref * 100 + 155, NORM_INF) > 0.01)
+	{
+		cout << "ERROR: Dip1::guidedFilter(): Result for inputs up to 255 differs from box filter based guided filter" << endl;
+		return;
+	}
+
+	// the fast guided filter approximates the exact one on smooth images
+	// mean absolute error below 0.03, i.e. 3% of the range of the guidance image
+	Mat I_smooth(45, 38, CV_32FC1), p_smooth(45, 38, CV_32FC1), exact;
+	for (int i = 0; i < I_smooth.rows; i++)
+	{
+		for (int j = 0; j < I_smooth.cols; j++)
+		{
+			I_smooth.at<float>(i, j) = 0.5 + 0.4 * std::sin(i * 0.15) * std::cos(j * 0.1);
+			p_smooth.at<float>(i, j) = 0.5 + 0.3 * std::cos(i * 0.08 + j * 0.12);
+		}
+	}
+	guidedFilter(I_smooth, p_smooth, exact, r, eps);
+	guidedFilter(I_smooth, p_smooth, output, r, eps, 2);
+	if ((I.cols != output.cols) || (I.rows != output.rows))
+	{
+		cout << "ERROR: Dip1::guidedFilter(): input.size != output.size for subsampling factor 2" << endl;
+		return;
+	}
+	if (norm(output, exact, NORM_L1) / output.total() > 0.03)
+	{
+		cout << "ERROR: Dip1::guidedFilter(): Result for subsampling factor 2 differs too much from the exact guided filter" << endl;
+		return;
+	}
+	cout << "Message: Dip1::guidedFilter() seems to be correct" << endl;
+}
+
+// compares the table based radiance recovery with the division based one
+void Dip1::test_recoverRadiance(void)
+{
+
+	Mat img(31, 47, CV_8UC3);
+	Mat trans(31, 47, CV_32FC1);
+	randu(img, 0, 256);
+	randu(trans, -0.1, 1.1);
+	float A[3] = {250, 180, 210};
+
+	Mat output;
+	recoverRadiance(img, trans, A, output);
+	Mat ref = recoverRadianceNaive(img, trans, A);
+	if ((img.cols != output.cols) || (img.rows != output.rows))
+	{
+		cout << "ERROR: Dip1::recoverRadiance(): input.size != output.size" << endl;
+		return;
+	}
+	if (norm(output, ref, NORM_INF) > 2)
+	{
+		cout << "ERROR: Dip1::recoverRadiance(): Result differs from division based radiance recovery" << endl;
+		return;
+	}
+	cout << "Message: Dip1::recoverRadiance() seems to be correct" << endl;
+}
+
+// compares the tiled dehazing with the one processing the whole image at once
+void Dip1::test_dehazeTiled(void)
+{
+
+	Mat img(90, 101, CV_8UC3);
+	randu(img, 0, 256);
+	GaussianBlur(img, img, Size(5, 5), 2);
+
+	DehazeContext serial, tiled;
+	dehaze(img, serial);
+	dehazeTiled(img, tiled, 32);
+	if (norm(serial.output, tiled.output, NORM_INF) > 0)
+	{
+		cout << "ERROR: Dip1::dehazeTiled(): Result differs from Dip1::dehaze()" << endl;
+		return;
+	}
+	cout << "Message: Dip1::dehazeTiled() seems to be correct" << endl;
+}
+
+// checks that a stream reuses the buffers of its context from frame to frame, whole image and tiled
+void Dip1::test_dehazeContext(void)
+{
+
+	Mat frames[2];
+	for (int n = 0; n < 2; n++)
+	{
+		frames[n].create(90, 101, CV_8UC3);
+		randu(frames[n], 0, 256);
+		GaussianBlur(frames[n], frames[n], Size(5, 5), 2);
+	}
+
+	for (int tiled = 0; tiled < 2; tiled++)
+	{
+		DehazeContext context;
+		const void *buffers[2][6];
+		for (int n = 0; n < 2; n++)
+		{
+			if (tiled)
+				dehazeTiled(frames[n], context, 32);
+			else
+				dehaze(frames[n], context);
+			GuidedFilterBuffers &guided = tiled ? context.tiles.back().guided : context.guided;
+			Mat &refined = tiled ? context.tiles.back().refined : context.refined;
+			const void *pointers[] = {guided.colI.data(), guided.sumA.data(), guided.ringA.data(), refined.data, context.output.data, tiled ? (const void *)context.tiles.data() : context.guide.data};
+			std::copy(pointers, pointers + 6, buffers[n]);
+		}
+		// tiles share the buffers of their thread
+		if (tiled && (int)context.tiles.size() > std::max(getNumThreads(), 1))
+		{
+			cout << "ERROR: Dip1::dehazeTiled(): " << context.tiles.size() << " tile buffers for " << getNumThreads() << " threads" << endl;
+			return;
+		}
+		for (int k = 0; k < 6; k++)
+		{
+			if (!buffers[0][k] || buffers[0][k] != buffers[1][k])
+			{
+				cout << "ERROR: Dip1::" << (tiled ? "dehazeTiled" : "dehaze") << "(): Buffer " << k << " of the context is not used or reallocated for the second frame" << endl;
+				return;
+			}
+		}
+	}
+
+	// update intervals below one frame re-estimate the atmospheric light for every frame
+	// the scene fades slowly, so only the update interval decides whether A follows
+	Mat fading[3];
+	for (int n = 0; n < 3; n++)
+		frames[0].convertTo(fading[n], CV_8UC3, 1 - 0.05 * n);
+	int intervals[] = {1, 0, -5, 30};
+	float A[4][3];
+	for (int k = 0; k < 4; k++)
+	{
+		DehazeContext context;
+		context.updateInterval = intervals[k];
+		for (int n = 0; n < 3; n++)
+			dehaze(fading[n], context);
+		std::copy(context.A, context.A + 3, A[k]);
+		if (k > 0 && std::equal(A[k], A[k] + 3, A[0]) != (intervals[k] < 1))
+		{
+			cout << "ERROR: Dip1::dehaze(): Update interval " << intervals[k] << (intervals[k] < 1 ? " does not behave as 1" : " does not skip updates") << endl;
+			return;
+		}
+	}
+	cout << "Message: Dip1::dehaze() and Dip1::dehazeTiled() reuse the buffers of their context" << endl;
+}
+
+// measures the processing time of the minimum filter for different window sizes
+// results are written to "minFilter.txt" (kSize, brute force [sec], van Herk/Gil-Werman [sec])
+/*
+fname	path to the input image
+*/
+void Dip1::benchmark(string fname)
+{
+
+	Mat inputImage = imread(fname);
+	if (!inputImage.data)
+	{
+		cout << "ERROR: Cannot read file " << fname << endl;
+		exit(-1);
+	}
+	Mat gray;
+	cvtColor(inputImage, gray, CV_BGR2GRAY);
+
+	fstream file("minFilter.txt", ios::out);
+	int kSizes[] = {3, 5, 9, 15, 21, 31, 41, 51, 61, 71, 81, 91, 101};
+	for (int k = 0; k < 13; k++)
+	{
+		int64 time = getTickCount();
+		Mat ref = minFilterNaive(gray, kSizes[k]);
+		double timeNaive = (getTickCount() - time) / getTickFrequency();
+
+		time = getTickCount();
+		Mat out = minFilter(gray, kSizes[k]);
+		double timeFast = (getTickCount() - time) / getTickFrequency();
+
+		cout << "> minFilter (" << kSizes[k] << "x" << kSizes[k] << "):\tbrute force " << timeNaive << "sec\tvan Herk/Gil-Werman " << timeFast << "sec" << endl;
+		file << kSizes[k] << " " << timeNaive << " " << timeFast << endl;
+	}
+	file.close();
+
+	// guided filter: fused single pass and fast guided filter with different subsampling factors
+	Mat I, p;
+	gray.convertTo(I, CV_32FC1, 1 / 255.0);
+	minFilter(gray, 15).convertTo(p, CV_32FC1, 1 / 255.0);
+	int factors[] = {1, 2, 4, 8};
+	Mat q;
+	for (int k = 0; k < 4; k++)
+	{
+		int64 time = getTickCount();
+		guidedFilter(I, p, q, 7, 0.001, factors[k]);
+		double timeGuided = (getTickCount() - time) / getTickFrequency();
+		cout << "> guidedFilter (r = 7, s = " << factors[k] << "):\t" << timeGuided << "sec" << endl;
+	}
+
+	// radiance recovery: cost per megapixel
+	float A[3] = {230, 230, 230};
+	double megapixels = inputImage.rows * inputImage.cols / 1e6;
+	Mat recovered;
+	int64 time = getTickCount();
+	for (int k = 0; k < 10; k++)
+		recovered = recoverRadianceNaive(inputImage, q, A);
+	double timeNaive = (getTickCount() - time) / getTickFrequency() / 10;
+	time = getTickCount();
+	for (int k = 0; k < 10; k++)
+		recoverRadiance(inputImage, q, A, recovered);
+	double timeTable = (getTickCount() - time) / getTickFrequency() / 10;
+	cout << "> recoverRadiance:\tdivision " << timeNaive * 1000 / megapixels << "ms/MP\ttable " << timeTable * 1000 / megapixels << "ms/MP" << endl;
+
+	// whole pipeline: serial and tiled on different numbers of threads
+	DehazeContext context;
+	time = getTickCount();
+	dehaze(inputImage, context);
+	double timeSerial = (getTickCount() - time) / getTickFrequency();
+	cout << "> dehaze (" << inputImage.cols << "x" << inputImage.rows << "):\tserial " << timeSerial << "sec" << endl;
+	int threads[] = {1, 2, 4, 8, 16};
+	for (int k = 0; k < 5; k++)
+	{
+		setNumThreads(threads[k]);
+		time = getTickCount();
+		dehazeTiled(inputImage, context);
+		double timeTiled = (getTickCount() - time) / getTickFrequency();
+		cout << "> dehazeTiled (" << threads[k] << " threads):\t" << timeTiled << "sec\tspeedup " << timeSerial / timeTiled << endl;
+	}
+	setNumThreads(-1);
+}
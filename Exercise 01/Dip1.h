@@ -12,6 +12,50 @@
 using namespace std;
 using namespace cv;
 
+// work buffers of the guided filter, reused as long as the image size does not change
+struct GuidedFilterBuffers{
+	// column sums of I, p, I*p, I*I and of a, b
+	vector<int64> colI, colP, colIp, colII, colA, colB;
+	// window sums of one row
+	vector<int64> sumI, sumP, sumIp, sumII, sumA, sumB;
+	// a, b of the last 2r+1 rows
+	vector<int64> ringA, ringB;
+	// subsampled images and upsampled coefficients of the fast guided filter
+	Mat I_sub, p_sub, coef;
+};
+
+// buffers of one thread of Dip1::dehazeTiled(..), large enough for a tile with its halo
+struct DehazeTile{
+	Mat dark, buffer, transposed, bufferTransposed, gray, transmission, guide, refined;
+	GuidedFilterBuffers guided;
+};
+
+// buffers and state of a dehazing stream, reused from frame to frame
+struct DehazeContext{
+
+	DehazeContext(void) : frames(0), updateInterval(30), smoothing(0.1), sceneThreshold(20) { A[0] = A[1] = A[2] = 255; };
+
+	// intermediate images
+	Mat dark, buffer, transposed, bufferTransposed, gray, transmission, guide, refined;
+	GuidedFilterBuffers guided;
+	// buffers of the tiles, one entry per thread (stripe of tiles)
+	vector<DehazeTile> tiles;
+	// small grayscale frame for scene change detection, at current frame and at last estimation of A
+	Mat thumbnail, reference;
+	// result of the last frame
+	Mat output;
+	// atmospheric light (B, G, R)
+	float A[3];
+	// number of processed frames
+	int frames;
+	// re-estimate A every updateInterval frames (values below 1 count as 1)
+	int updateInterval;
+	// weight of a new estimate of A
+	float smoothing;
+	// mean absolute difference of the thumbnails that is treated as scene change
+	double sceneThreshold;
+};
+
 class Dip1{
 
 	public:
@@ -22,14 +66,46 @@ class Dip1{
 		
 		// processing routine
 		void run(string);
+		// processing routine for videos (or camera index)
+		void runVideo(string, string, int updateInterval = 30);
+		// processing routine for many images, without display
+		void runBatch(string, string, int jobs = 0);
 		// testing routine
 		void test(string);
+		// benchmarking routine
+		void benchmark(string);
 
 	private:
 		// function that performs some kind of (simple) image processing
 		// --> please edit ONLY these functions!
 		Mat doSomethingThatMyTutorIsGonnaLike(const Mat&);
+		void dehaze(const Mat& img, DehazeContext& context);
+		void dehazeTiled(const Mat& img, DehazeContext& context, int tileSize = 256);
+		// steps of the dehazing
+		void darkChannel(const Mat& img, Mat& dst);
+		void updateAtmosphericLight(const Mat& img, DehazeContext& context);
+		void transmissionMap(const Mat& dark, const float* A, Mat& dst);
+		void normalizeGray(const Mat& gray, Mat& dst);
+		// minimum filter (erosion with a square structuring element)
+		Mat minFilter(const Mat& src, int kSize);
+		void minFilterVertical(const Mat& src, Mat& dst, int kSize);
+		// brute force minimum filter, used as reference
+		Mat minFilterNaive(const Mat& src, int kSize);
+		// atmospheric light from the brightest pixels of the dark channel
+		void atmosphericLight(const Mat& img, const Mat& dark, int* A);
+		// guided image filter (s > 1: fast guided filter with subsampling factor s)
+		void guidedFilter(const Mat& I, const Mat& p, Mat& dst, int r, double eps, int s = 1, GuidedFilterBuffers* buffers = 0);
+		void fusedGuidedFilter(const Mat& I, const Mat& p, int r, double eps, Mat& dst, bool coefficients, GuidedFilterBuffers& buffers);
+		// scene radiance from transmission and atmospheric light
+		void recoverRadiance(const Mat& img, const Mat& trans, const float* A, Mat& dst);
+		Mat recoverRadianceNaive(const Mat& img, const Mat& trans, const float* A);
 
 		// test function
 		void test_doSomethingThatMyTutorIsGonnaLike(const Mat&, const Mat&);
+		void test_minFilter(void);
+		void test_atmosphericLight(void);
+		void test_guidedFilter(void);
+		void test_recoverRadiance(void);
+		void test_dehazeTiled(void);
+		void test_dehazeContext(void);
 };
@@ -13,15 +13,44 @@
 using namespace std;
 
 // usage: path to image in argv[1]
+// 	  argv[1] == "benchmark" to measure processing times, path to image in argv[2]
+// 	  argv[1] == "video" to dehaze a video, path to input (or camera index) in argv[2], path to output in argv[3],
+// 	                     (optional) update interval of the atmospheric light in argv[4]
+// 	  argv[1] == "batch" to dehaze many images without display, directory or glob pattern in argv[2],
+// 	                     output directory in argv[3], (optional) number of concurrent jobs in argv[4]
 // main function. loads and saves image
 int main(int argc, char** argv) {
 
 	// will contain path to input image (taken from argv[1])
 	string fname;
 
+	// measure processing times only
+	if (argc == 3 && string(argv[1]) == "benchmark"){
+	    Dip1 dip1;
+	    dip1.benchmark(argv[2]);
+	    return 0;
+	}
+
+	// process a video stream
+	if ((argc == 4 || argc == 5) && string(argv[1]) == "video"){
+	    Dip1 dip1;
+	    dip1.runVideo(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 30);
+	    return 0;
+	}
+
+	// process many images
+	if ((argc == 4 || argc == 5) && string(argv[1]) == "batch"){
+	    Dip1 dip1;
+	    dip1.runBatch(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 0);
+	    return 0;
+	}
+
 	// check if image path was defined
 	if (argc != 2){
-	    cout << "Usage: dip1 <path_to_image>" << endl;
+	    cout << "Usage: dehaze <path_to_image>" << endl;
+	    cout << "       dehaze benchmark <path_to_image>" << endl;
+	    cout << "       dehaze video <path_to_video|camera_index> <path_to_output> [update_interval]" << endl;
+	    cout << "       dehaze batch <directory|glob_pattern> <output_directory> [jobs]" << endl;
 	    cout << "Press enter to continue..." << endl;
 	    cin.get();
 	    return -1;
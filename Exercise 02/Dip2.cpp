@@ -7,24 +7,98 @@
 //============================================================================
 
 #include "Dip2.h"
+#include "convolution.h"
+#include <climits>
+#include <fstream>
+#include <map>
+#include <mutex>
 #include <time.h>
 
+// vector engines of the filters below, chosen at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DIP2_X86_ENGINES
+// vectors are only passed between functions compiled for the same instruction set
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+int blockSize; //Block for comparision
+
 // convolution in spatial domain
+// 8-bit and 16-bit images are convolved in fixed point, see common/convolution.cpp
 /*
-src:     input image
+src:     input image (CV_8UC1, CV_16UC1 or CV_32FC1)
 kernel:  filter kernel
+ddepth:  depth of the output (CV_8U, CV_16U, CV_16S or CV_32F), -1: depth of src
 return:  convolution result
 */
-int blockSize; //Block for comparision
+Mat Dip2::spatialConvolution(Mat &src, Mat &kernel, int ddepth)
+{
+	int ry = (kernel.rows - 1) / 2;
+	int rx = (kernel.cols - 1) / 2;
+	Mat src_padding, kernel_flipped;
+	copyMakeBorder(src, src_padding, ry, ry, rx, rx, BORDER_REPLICATE);
+	flip(kernel, kernel_flipped, -1); //Coordinates flipped
+	if (ddepth < 0)
+		ddepth = src.depth();
+
+	if (src.depth() == CV_8U || src.depth() == CV_16U)
+	{
+		Mat dst(src.rows, src.cols, CV_MAKETYPE(ddepth, 1));
+		double maxValue = src.depth() == CV_8U ? 255 : 65535;
+		// rank 1 kernels (e.g. Gaussian) in two passes
+		SeparableKernel separable = kernel.rows > 1 && kernel.cols > 1 ? separableKernel(kernel_flipped) : SeparableKernel();
+		if (separable.separable && separable.columns.size() == 1)
+		{
+			if (src.depth() == CV_8U)
+				convolveFixedSeparable<uchar>(src_padding, separable.columns[0], separable.rows[0], maxValue, dst);
+			else
+				convolveFixedSeparable<ushort>(src_padding, separable.columns[0], separable.rows[0], maxValue, dst);
+			return dst;
+		}
+		FixedKernel fixed = fixedKernel(kernel_flipped, maxValue);
+		if (src.depth() == CV_8U)
+			convolveFixedDepth<uchar>(src_padding, fixed, dst, fixed.shift);
+		else
+			convolveFixedDepth<ushort>(src_padding, fixed, dst, fixed.shift);
+		return dst;
+	}
+
+	Mat dst(src.rows, src.cols, CV_32FC1);
+
+	// low-rank kernels are applied as sum of row and column passes
+	if (kernel.rows > 1 && kernel.cols > 1)
+	{
+		SeparableKernel separable = separableKernel(kernel_flipped);
+		if (separable.separable)
+		{
+			convolveSeparable(src_padding, separable, dst, convolutionEngine());
+			if (ddepth != CV_32F)
+				dst.convertTo(dst, ddepth);
+			return dst;
+		}
+	}
+	convolve2D(src_padding, kernel_flipped, dst, convolutionEngine());
+	if (ddepth != CV_32F)
+		dst.convertTo(dst, ddepth);
 
-Mat Dip2::spatialConvolution(Mat &src, Mat &kernel)
+	return dst;
+}
+
+// straightforward convolution, reference for the convolution engines
+/*
+src:     input image
+kernel:  filter kernel
+return:  convolution result
+*/
+Mat Dip2::spatialConvolutionNaive(Mat &src, Mat &kernel)
 {
 	int kSize = kernel.rows;
 	int r = (kSize - 1) / 2;
 	int rows = src.rows;
 	int cols = src.cols;
 	Mat dst(rows, cols, CV_32FC1);
-	Mat src_padding(rows + kSize - 1, cols + kSize - 1, CV_32FC1);
+	Mat src_padding;
 	Mat kernel_flipped(kernel.rows, kernel.cols, CV_32FC1);
 	copyMakeBorder(src, src_padding, r, r, r, r, BORDER_REPLICATE);
 
@@ -67,37 +141,180 @@ Mat Dip2::spatialConvolution(Mat &src, Mat &kernel)
 	return dst;
 }
 
+// horizontal running sum of one row
+/*
+data:    source row
+index:   clamped column index for every window position, cols + kSize - 1 entries
+out:     sum of the kSize values of the window starting at every column
+*/
+template <typename SrcT, typename SumT>
+static void rowRunningSum(const SrcT *data, const int *index, int cols, int kSize, SumT *out)
+{
+	SumT sum = 0;
+	for (int n = 0; n < kSize; n++)
+		sum += data[index[n]];
+	out[0] = sum;
+	for (int j = 1; j < cols; j++)
+	{
+		sum += data[index[j + kSize - 1]] - data[index[j - 1]];
+		out[j] = sum;
+	}
+}
+
+// writes the averages of one row
+// sums are scaled by 1 / count, integer results are rounded half up
+/*
+columnSum:  sums of the windows
+cols:       number of columns
+count:      number of pixels per window
+dst:        output row
+*/
+static inline void storeAverage(const double *columnSum, int cols, int count, float *dst)
+{
+	double weight = 1. / count;
+	for (int j = 0; j < cols; j++)
+		dst[j] = (float)(columnSum[j] * weight);
+}
+
+template <typename SumT>
+static inline void storeAverage(const SumT *columnSum, int cols, int count, float *dst)
+{
+	float weight = 1.f / count;
+	for (int j = 0; j < cols; j++)
+		dst[j] = columnSum[j] * weight;
+}
+
+template <typename SumT, typename DstT>
+static inline void storeAverage(const SumT *columnSum, int cols, int count, DstT *dst)
+{
+	// averages of unsigned values are within the range of the source, no saturation needed
+	double weight = 1. / count;
+	for (int j = 0; j < cols; j++)
+		dst[j] = (DstT)(int)(columnSum[j] * weight + 0.5);
+}
+
+// moving average by running sums, constant cost per pixel independent of kSize
+// the horizontal sums of the last kSize rows are kept in a ring buffer,
+// the vertical sum adds the row entering the window and subtracts the one leaving it
+// borders are replicated, float sums are kept in double precision so they do not drift on large images,
+// integer sums are exact
+/*
+src:     input image (SrcT)
+dst:     output image (DstT), same size as src
+kSize:   window size
+*/
+template <typename SrcT, typename SumT, typename DstT>
+static void movingAverage(const Mat &src, Mat &dst, int kSize)
+{
+	int rows = src.rows;
+	int cols = src.cols;
+	int lo = -(kSize - 1) / 2; // window covers [lo, lo + kSize) around the centre, as the padded convolution
+
+	vector<int> index(cols + kSize - 1);
+	for (int j = 0; j < cols + kSize - 1; j++)
+		index[j] = std::min(std::max(j + lo, 0), cols - 1);
+
+	vector<SumT> ring((size_t)kSize * cols);
+	vector<SumT> columnSum(cols, 0);
+	for (int m = 0; m < kSize; m++)
+	{
+		SumT *ring_data = &ring[(size_t)m * cols];
+		rowRunningSum(src.ptr<SrcT>(std::min(std::max(m + lo, 0), rows - 1)), &index[0], cols, kSize, ring_data);
+		for (int j = 0; j < cols; j++)
+			columnSum[j] += ring_data[j];
+	}
+
+	for (int i = 0; i < rows; i++)
+	{
+		if (i > 0)
+		{
+			// the row leaving the window is replaced by the one entering it
+			SumT *ring_data = &ring[(size_t)((i - 1) % kSize) * cols];
+			for (int j = 0; j < cols; j++)
+				columnSum[j] -= ring_data[j];
+			rowRunningSum(src.ptr<SrcT>(std::min(std::max(i + lo + kSize - 1, 0), rows - 1)), &index[0], cols, kSize, ring_data);
+			for (int j = 0; j < cols; j++)
+				columnSum[j] += ring_data[j];
+		}
+		storeAverage(&columnSum[0], cols, kSize * kSize, dst.ptr<DstT>(i));
+	}
+}
+
+// moving average of an 8-bit or 16-bit image in integer arithmetic
+/*
+src:     input image (SrcT)
+dst:     output image, same size as src
+kSize:   window size
+*/
+template <typename SrcT, typename SumT>
+static void movingAverageFixed(const Mat &src, Mat &dst, int kSize)
+{
+	switch (dst.depth())
+	{
+	case CV_8U:
+		movingAverage<SrcT, SumT, uchar>(src, dst, kSize);
+		break;
+	case CV_16U:
+		movingAverage<SrcT, SumT, ushort>(src, dst, kSize);
+		break;
+	default:
+		movingAverage<SrcT, SumT, float>(src, dst, kSize);
+	}
+}
+
 // the average filter
 // HINT: you might want to use Dip2::spatialConvolution(...) within this function
+// 8-bit and 16-bit images are summed up in integer arithmetic (exact), the averages are rounded half up
 /*
-src:     input image
+src:     input image (CV_8UC1, CV_16UC1 or CV_32FC1)
 kSize:   window size used by local average
+ddepth:  depth of the output (CV_8U, CV_16U or CV_32F), -1: depth of src
 return:  filtered image
 */
-Mat Dip2::averageFilter(Mat &src, int kSize)
+Mat Dip2::averageFilter(Mat &src, int kSize, int ddepth)
 {
-	float weight = (float)1 / (kSize * kSize);
-	Mat kernel(kSize, kSize, CV_32FC1, Scalar::all(weight));
-	return spatialConvolution(src, kernel);
+	if (ddepth < 0)
+		ddepth = src.depth();
+	if (src.depth() == CV_8U || src.depth() == CV_16U)
+	{
+		Mat dst(src.rows, src.cols, CV_MAKETYPE(ddepth, 1));
+		// 32 bit sums as long as the window sum cannot overflow
+		if (src.depth() == CV_8U)
+			movingAverageFixed<uchar, int>(src, dst, kSize);
+		else if (65535. * kSize * kSize <= INT_MAX)
+			movingAverageFixed<ushort, int>(src, dst, kSize);
+		else
+			movingAverageFixed<ushort, int64>(src, dst, kSize);
+		return dst;
+	}
+
+	Mat dst(src.rows, src.cols, CV_32FC1);
+	movingAverage<float, double, float>(src, dst, kSize);
+	if (ddepth != CV_32F)
+		dst.convertTo(dst, ddepth);
+	return dst;
 }
 
-// the median filter
+// median filter engines
+// every engine writes the median of the kSize x kSize window around every pixel to dst (CV_32FC1),
+// borders are replicated
+
+// sorts the values of every window
 /*
-src:     input image
-kSize:   window size used by median operation
-return:  filtered image
+src:     input image (CV_32FC1)
+dst:     output image
+kSize:   window size
 */
-Mat Dip2::medianFilter(Mat &src, int kSize)
+static void medianSort(const Mat &src, Mat &dst, int kSize)
 {
 	int r = kSize / 2;
 	int rows = src.rows;
 	int cols = src.cols;
-	Mat dst(rows, cols, CV_32FC1);
-	Mat src_padding(rows + kSize - 1, cols + kSize - 1, CV_32FC1);
+	Mat src_padding;
 	copyMakeBorder(src, src_padding, r, r, r, r, BORDER_REPLICATE);
 	int i, j, m, n, count = 0;
 	int k_square = kSize * kSize;
-	float temp[k_square];
+	vector<float> temp(k_square);
 
 	for (i = 0; i < rows; i++)
 	{
@@ -113,7 +330,7 @@ Mat Dip2::medianFilter(Mat &src, int kSize)
 					temp[count++] = *data++;
 				}
 			}
-			std::sort(temp, temp + k_square);
+			std::sort(temp.begin(), temp.end());
 			*dst_data = temp[k_square / 2];
 			dst_data++;
 			count = 0;
@@ -174,30 +391,637 @@ Mat Dip2::medianFilter(Mat &src, int kSize)
 			dst_data++;
 		}
 	}*/
+}
+
+// 8-bit histogram with 16 coarse bins of 16 fine bins each
+// the median is found by scanning at most 16 coarse and 16 fine bins
+struct MedianHistogram
+{
+	unsigned short coarse[16];
+	unsigned short fine[256];
+};
+
+// value of given rank (0-based) in a histogram
+static int histogramMedian(const unsigned short *coarse, const unsigned short *fine, int rank)
+{
+	int c = 0, count = 0;
+	while (count + coarse[c] <= rank)
+		count += coarse[c++];
+	int v = c * 16;
+	while (count + fine[v] <= rank)
+		count += fine[v++];
+	return v;
+}
+
+// Huang: one sliding histogram per row, kSize values enter and leave the histogram per pixel
+/*
+padded:  8-bit input image, padded by kSize / 2 on every side
+dst:     output image
+kSize:   window size
+*/
+static void medianHuang(const Mat &padded, Mat &dst, int kSize)
+{
+	int rank = kSize * kSize / 2;
+	MedianHistogram hist;
+	for (int i = 0; i < dst.rows; i++)
+	{
+		memset(&hist, 0, sizeof(hist));
+		for (int m = 0; m < kSize; m++)
+		{
+			const uchar *data = padded.ptr<uchar>(i + m);
+			for (int n = 0; n < kSize; n++)
+			{
+				hist.fine[data[n]]++;
+				hist.coarse[data[n] >> 4]++;
+			}
+		}
+		float *dst_data = dst.ptr<float>(i);
+		dst_data[0] = (float)histogramMedian(hist.coarse, hist.fine, rank);
+		for (int j = 1; j < dst.cols; j++)
+		{
+			// column j - 1 leaves, column j + kSize - 1 enters the window
+			for (int m = 0; m < kSize; m++)
+			{
+				const uchar *data = padded.ptr<uchar>(i + m);
+				uchar out = data[j - 1], in = data[j + kSize - 1];
+				hist.fine[out]--;
+				hist.coarse[out >> 4]--;
+				hist.fine[in]++;
+				hist.coarse[in >> 4]++;
+			}
+			dst_data[j] = (float)histogramMedian(hist.coarse, hist.fine, rank);
+		}
+	}
+}
+
+// Perreault and Hebert: one histogram per column of the padded image covering the kSize rows of the window
+// moving one row down updates every column histogram by one value, moving one column right
+// adds one column histogram to the window histogram and subtracts another
+// the coarse bins are updated for every pixel, a fine segment only when the median search enters it,
+// so the cost per pixel does not depend on kSize
+/*
+padded:  8-bit input image, padded by kSize / 2 on every side
+dst:     output image
+kSize:   window size
+*/
+static void medianPerreault(const Mat &padded, Mat &dst, int kSize)
+{
+	int rank = kSize * kSize / 2;
+	int cols = padded.cols;
+	vector<MedianHistogram> columns(cols);
+	MedianHistogram hist;
+	int segment[16]; // column at which every fine segment of hist was last valid
+
+	memset(&columns[0], 0, cols * sizeof(MedianHistogram));
+	for (int m = 0; m < kSize - 1; m++)
+	{
+		const uchar *data = padded.ptr<uchar>(m);
+		for (int x = 0; x < cols; x++)
+		{
+			columns[x].fine[data[x]]++;
+			columns[x].coarse[data[x] >> 4]++;
+		}
+	}
+
+	for (int i = 0; i < dst.rows; i++)
+	{
+		// column histograms now cover padded rows i .. i + kSize - 1
+		const uchar *in = padded.ptr<uchar>(i + kSize - 1);
+		const uchar *out = i > 0 ? padded.ptr<uchar>(i - 1) : 0;
+		for (int x = 0; x < cols; x++)
+		{
+			columns[x].fine[in[x]]++;
+			columns[x].coarse[in[x] >> 4]++;
+			if (out)
+			{
+				columns[x].fine[out[x]]--;
+				columns[x].coarse[out[x] >> 4]--;
+			}
+		}
+
+		memset(&hist, 0, sizeof(hist));
+		for (int x = 0; x < kSize; x++)
+			for (int c = 0; c < 16; c++)
+				hist.coarse[c] += columns[x].coarse[c];
+		for (int c = 0; c < 16; c++)
+			segment[c] = -kSize; // no fine segment valid yet
+
+		float *dst_data = dst.ptr<float>(i);
+		for (int j = 0; j < dst.cols; j++)
+		{
+			if (j > 0)
+			{
+				const unsigned short *leave = columns[j - 1].coarse;
+				const unsigned short *enter = columns[j + kSize - 1].coarse;
+				for (int c = 0; c < 16; c++)
+					hist.coarse[c] += enter[c] - leave[c];
+			}
+
+			// coarse bin of the median
+			int c = 0, count = 0;
+			while (count + hist.coarse[c] <= rank)
+				count += hist.coarse[c++];
+
+			// bring the fine segment of this bin up to date
+			unsigned short *fine = hist.fine + c * 16;
+			if (j - segment[c] >= kSize)
+			{
+				memset(fine, 0, 16 * sizeof(unsigned short));
+				for (int x = j; x < j + kSize; x++)
+					for (int v = 0; v < 16; v++)
+						fine[v] += columns[x].fine[c * 16 + v];
+			}
+			else
+			{
+				for (int x = segment[c]; x < j; x++)
+					for (int v = 0; v < 16; v++)
+						fine[v] += columns[x + kSize].fine[c * 16 + v] - columns[x].fine[c * 16 + v];
+			}
+			segment[c] = j;
+
+			int v = 0;
+			while (count + fine[v] <= rank)
+				count += fine[v++];
+			dst_data[j] = (float)(c * 16 + v);
+		}
+	}
+}
+
+// sorting network median for kSize 3 and 5
+// for every output row the kSize values of every column are sorted once and shared by the kSize windows
+// containing that column; each window then runs a fixed min/max network on its kSize sorted columns
+// the networks are branchless and unrolled at compile time, so the vector versions compute
+// one median per lane: 4 / 8 (float) or 16 / 32 (8 bit) pixels at once
+
+// compare-exchange of elements a and b (min to a, max to b); if only one result is used later,
+// the other is not computed
+enum CompareExchangeOp
+{
+	CE_BOTH,
+	CE_MIN,
+	CE_MAX
+};
+struct CompareExchange
+{
+	unsigned char a, b, op;
+};
+
+// sorts kSize values
+static constexpr CompareExchange COLUMN_SORT_3[] = {{0, 1, CE_BOTH}, {1, 2, CE_BOTH}, {0, 1, CE_BOTH}};
+static constexpr CompareExchange COLUMN_SORT_5[] = {{0, 1, CE_BOTH}, {3, 4, CE_BOTH}, {2, 4, CE_BOTH}, {2, 3, CE_BOTH}, {0, 3, CE_BOTH},
+													{0, 2, CE_BOTH}, {1, 4, CE_BOTH}, {1, 3, CE_BOTH}, {1, 2, CE_BOTH}};
+// median of a window given as kSize sorted columns, element c * kSize + r is the r-th smallest value of column c
+// derived from: sort the values of equal rank across the columns (rows and columns are sorted afterwards),
+// drop the elements that are known to be below or above the median, sort the remaining candidates;
+// compare-exchanges with known result or unused output were removed, the result was verified for all
+// 0-1 inputs with sorted columns
+static constexpr CompareExchange WINDOW_MEDIAN_3[] = {
+	{0, 3, CE_MAX}, {3, 6, CE_MAX}, {1, 4, CE_BOTH}, {4, 7, CE_MIN}, {1, 4, CE_MAX}, {2, 5, CE_BOTH},
+	{5, 8, CE_MIN}, {2, 5, CE_MIN}, {2, 6, CE_BOTH}, {2, 4, CE_MAX}, {4, 6, CE_MIN}};
+static const int WINDOW_MEDIAN_3_AT = 4;
+static constexpr CompareExchange WINDOW_MEDIAN_5[] = {
+	{0, 5, CE_BOTH}, {15, 20, CE_BOTH}, {10, 20, CE_BOTH}, {10, 15, CE_MAX}, {0, 15, CE_MAX},
+	{5, 20, CE_BOTH}, {5, 15, CE_MAX}, {1, 6, CE_BOTH}, {16, 21, CE_BOTH}, {11, 21, CE_BOTH},
+	{11, 16, CE_BOTH}, {1, 16, CE_BOTH}, {1, 11, CE_MAX}, {6, 21, CE_BOTH}, {6, 16, CE_BOTH},
+	{6, 11, CE_MAX}, {2, 7, CE_BOTH}, {17, 22, CE_BOTH}, {12, 22, CE_BOTH}, {12, 17, CE_BOTH},
+	{2, 17, CE_BOTH}, {2, 12, CE_MAX}, {7, 22, CE_MIN}, {7, 17, CE_BOTH}, {7, 12, CE_BOTH},
+	{3, 8, CE_BOTH}, {18, 23, CE_BOTH}, {13, 23, CE_BOTH}, {13, 18, CE_BOTH}, {3, 18, CE_BOTH},
+	{3, 13, CE_BOTH}, {8, 23, CE_MIN}, {8, 18, CE_MIN}, {8, 13, CE_BOTH}, {4, 9, CE_BOTH},
+	{19, 24, CE_BOTH}, {14, 24, CE_BOTH}, {14, 19, CE_BOTH}, {4, 19, CE_BOTH}, {4, 14, CE_BOTH},
+	{9, 24, CE_MIN}, {9, 19, CE_MIN}, {9, 14, CE_MIN}, {15, 13, CE_BOTH}, {20, 11, CE_BOTH},
+	{3, 16, CE_BOTH}, {4, 21, CE_BOTH}, {15, 4, CE_BOTH}, {20, 9, CE_BOTH}, {13, 21, CE_BOTH},
+	{4, 13, CE_BOTH}, {9, 11, CE_BOTH}, {8, 16, CE_BOTH}, {15, 7, CE_BOTH}, {20, 3, CE_BOTH},
+	{4, 12, CE_BOTH}, {9, 8, CE_BOTH}, {13, 17, CE_BOTH}, {11, 16, CE_BOTH}, {7, 13, CE_BOTH},
+	{12, 21, CE_BOTH}, {7, 4, CE_BOTH}, {3, 9, CE_BOTH}, {12, 13, CE_BOTH}, {8, 11, CE_BOTH},
+	{17, 21, CE_MIN}, {15, 20, CE_MAX}, {7, 3, CE_MAX}, {4, 9, CE_MAX}, {12, 8, CE_MIN},
+	{13, 11, CE_MIN}, {17, 16, CE_MIN}, {20, 13, CE_MAX}, {3, 17, CE_MIN}, {3, 12, CE_MAX},
+	{9, 13, CE_MIN}, {9, 12, CE_MAX}};
+static const int WINDOW_MEDIAN_5_AT = 12;
+
+template <int K>
+struct MedianNetwork;
+template <>
+struct MedianNetwork<3>
+{
+	enum { columnSize = 3, windowSize = 11, median = WINDOW_MEDIAN_3_AT };
+	static constexpr CompareExchange column(int i) { return COLUMN_SORT_3[i]; }
+	static constexpr CompareExchange window(int i) { return WINDOW_MEDIAN_3[i]; }
+};
+template <>
+struct MedianNetwork<5>
+{
+	enum { columnSize = 9, windowSize = 77, median = WINDOW_MEDIAN_5_AT };
+	static constexpr CompareExchange column(int i) { return COLUMN_SORT_5[i]; }
+	static constexpr CompareExchange window(int i) { return WINDOW_MEDIAN_5[i]; }
+};
+
+// applies compare-exchange I and all following ones, unrolled at compile time
+template <class Ops, int K, bool COLUMN, int I, bool END = (I == (COLUMN ? MedianNetwork<K>::columnSize : MedianNetwork<K>::windowSize))>
+struct SortingNetwork
+{
+	static inline void apply(typename Ops::V *v)
+	{
+		constexpr CompareExchange ce = COLUMN ? MedianNetwork<K>::column(I) : MedianNetwork<K>::window(I);
+		typename Ops::V a = v[ce.a], b = v[ce.b];
+		if (ce.op != CE_MAX)
+			v[ce.a] = Ops::min(a, b);
+		if (ce.op != CE_MIN)
+			v[ce.b] = Ops::max(a, b);
+		SortingNetwork<Ops, K, COLUMN, I + 1>::apply(v);
+	}
+};
+template <class Ops, int K, bool COLUMN, int I>
+struct SortingNetwork<Ops, K, COLUMN, I, true>
+{
+	static inline void apply(typename Ops::V *) {}
+};
+
+// element operations of the networks, T: pixel type, V: values processed at once
+template <typename Type>
+struct NetworkScalar
+{
+	typedef Type T;
+	typedef Type V;
+	typedef NetworkScalar<Type> Scalar;
+	enum { width = 1 };
+	static inline V load(const T *p) { return *p; }
+	static inline void store(T *p, V v) { *p = v; }
+	static inline V min(V a, V b) { return a < b ? a : b; }
+	static inline V max(V a, V b) { return a < b ? b : a; }
+};
+
+#ifdef DIP2_X86_ENGINES
+struct NetworkSSE4F
+{
+	typedef float T;
+	typedef __m128 V;
+	typedef NetworkScalar<float> Scalar;
+	enum { width = 4 };
+	__attribute__((target("sse4.1"))) static inline V load(const T *p) { return _mm_loadu_ps(p); }
+	__attribute__((target("sse4.1"))) static inline void store(T *p, V v) { _mm_storeu_ps(p, v); }
+	__attribute__((target("sse4.1"))) static inline V min(V a, V b) { return _mm_min_ps(a, b); }
+	__attribute__((target("sse4.1"))) static inline V max(V a, V b) { return _mm_max_ps(a, b); }
+};
+struct NetworkSSE4U8
+{
+	typedef uchar T;
+	typedef __m128i V;
+	typedef NetworkScalar<uchar> Scalar;
+	enum { width = 16 };
+	__attribute__((target("sse4.1"))) static inline V load(const T *p) { return _mm_loadu_si128((const __m128i *)p); }
+	__attribute__((target("sse4.1"))) static inline void store(T *p, V v) { _mm_storeu_si128((__m128i *)p, v); }
+	__attribute__((target("sse4.1"))) static inline V min(V a, V b) { return _mm_min_epu8(a, b); }
+	__attribute__((target("sse4.1"))) static inline V max(V a, V b) { return _mm_max_epu8(a, b); }
+};
+struct NetworkAVX2F
+{
+	typedef float T;
+	typedef __m256 V;
+	typedef NetworkScalar<float> Scalar;
+	enum { width = 8 };
+	__attribute__((target("avx2"))) static inline V load(const T *p) { return _mm256_loadu_ps(p); }
+	__attribute__((target("avx2"))) static inline void store(T *p, V v) { _mm256_storeu_ps(p, v); }
+	__attribute__((target("avx2"))) static inline V min(V a, V b) { return _mm256_min_ps(a, b); }
+	__attribute__((target("avx2"))) static inline V max(V a, V b) { return _mm256_max_ps(a, b); }
+};
+struct NetworkAVX2U8
+{
+	typedef uchar T;
+	typedef __m256i V;
+	typedef NetworkScalar<uchar> Scalar;
+	enum { width = 32 };
+	__attribute__((target("avx2"))) static inline V load(const T *p) { return _mm256_loadu_si256((const __m256i *)p); }
+	__attribute__((target("avx2"))) static inline void store(T *p, V v) { _mm256_storeu_si256((__m256i *)p, v); }
+	__attribute__((target("avx2"))) static inline V min(V a, V b) { return _mm256_min_epu8(a, b); }
+	__attribute__((target("avx2"))) static inline V max(V a, V b) { return _mm256_max_epu8(a, b); }
+};
+#endif
+
+// sorts the columns [x0, x1) of the window rows starting at padded row i
+template <class Ops, int K>
+static inline void sortColumns(const Mat &padded, Mat &sorted, int i, int x0, int x1)
+{
+	typedef typename Ops::T T;
+	for (int x = x0; x + Ops::width <= x1; x += Ops::width)
+	{
+		typename Ops::V v[K];
+		for (int r = 0; r < K; r++)
+			v[r] = Ops::load(padded.ptr<T>(i + r) + x);
+		SortingNetwork<Ops, K, true, 0>::apply(v);
+		for (int r = 0; r < K; r++)
+			Ops::store(sorted.ptr<T>(r) + x, v[r]);
+	}
+}
+
+// medians of the windows starting at columns [j0, j1)
+template <class Ops, int K>
+static inline void windowMedians(const Mat &sorted, typename Ops::T *result, int j0, int j1)
+{
+	typedef typename Ops::T T;
+	for (int j = j0; j + Ops::width <= j1; j += Ops::width)
+	{
+		typename Ops::V v[K * K];
+		for (int c = 0; c < K; c++)
+			for (int r = 0; r < K; r++)
+				v[c * K + r] = Ops::load(sorted.ptr<T>(r) + j + c);
+		SortingNetwork<Ops, K, false, 0>::apply(v);
+		Ops::store(result + j, v[MedianNetwork<K>::median]);
+	}
+}
+
+/*
+padded:  input image (8 bit or float), padded by K / 2 on every side
+dst:     output image
+*/
+template <class Ops, int K>
+static void medianNetwork(const Mat &padded, Mat &dst)
+{
+	typedef typename Ops::T T;
+	typedef typename Ops::Scalar Scalar;
+	int width = padded.cols;
+	Mat sorted(K, width, padded.type());
+	vector<T> result(dst.cols);
+	for (int i = 0; i < dst.rows; i++)
+	{
+		// vectors first, remaining columns one by one
+		int x = width - width % Ops::width;
+		sortColumns<Ops, K>(padded, sorted, i, 0, x);
+		sortColumns<Scalar, K>(padded, sorted, i, x, width);
+
+		int j = dst.cols - dst.cols % Ops::width;
+		windowMedians<Ops, K>(sorted, &result[0], 0, j);
+		windowMedians<Scalar, K>(sorted, &result[0], j, dst.cols);
+
+		float *dst_data = dst.ptr<float>(i);
+		for (j = 0; j < dst.cols; j++)
+			dst_data[j] = (float)result[j];
+	}
+}
+
+#ifdef DIP2_X86_ENGINES
+// the vector operations are only inlined into code compiled for the same instruction set
+template <class Ops, int K>
+__attribute__((target("sse4.1"), flatten)) static void medianNetworkSSE4(const Mat &padded, Mat &dst)
+{
+	medianNetwork<Ops, K>(padded, dst);
+}
+template <class Ops, int K>
+__attribute__((target("avx2"), flatten)) static void medianNetworkAVX2(const Mat &padded, Mat &dst)
+{
+	medianNetwork<Ops, K>(padded, dst);
+}
+#endif
+
+typedef void (*MedianRows)(const Mat &, Mat &);
+
+// chooses the fastest network supported by the CPU
+/*
+depth:   CV_8U or CV_32F
+kSize:   3 or 5
+*/
+template <int K>
+static MedianRows medianNetworkEngine(int depth)
+{
+#ifdef DIP2_X86_ENGINES
+	if (checkHardwareSupport(CV_CPU_AVX2))
+		return depth == CV_8U ? medianNetworkAVX2<NetworkAVX2U8, K> : medianNetworkAVX2<NetworkAVX2F, K>;
+	if (checkHardwareSupport(CV_CPU_SSE4_1))
+		return depth == CV_8U ? medianNetworkSSE4<NetworkSSE4U8, K> : medianNetworkSSE4<NetworkSSE4F, K>;
+#endif
+	return depth == CV_8U ? medianNetwork<NetworkScalar<uchar>, K> : medianNetwork<NetworkScalar<float>, K>;
+}
+
+// kernel sizes from which the histogram engines are used for 8-bit images
+static const int MEDIAN_HUANG_MIN = 3;
+static const int MEDIAN_PERREAULT_MIN = 9;
+
+enum MedianEngine
+{
+	MEDIAN_SORT,
+	MEDIAN_NETWORK,
+	MEDIAN_HUANG,
+	MEDIAN_PERREAULT
+};
+
+// chooses the median engine from image depth and kernel size
+static MedianEngine medianEngine(int depth, int kSize)
+{
+	if ((depth == CV_8U || depth == CV_32F) && (kSize == 3 || kSize == 5))
+		return MEDIAN_NETWORK;
+	if (depth != CV_8U || kSize < MEDIAN_HUANG_MIN)
+		return MEDIAN_SORT;
+	if (kSize < MEDIAN_PERREAULT_MIN)
+		return MEDIAN_HUANG;
+	return MEDIAN_PERREAULT;
+}
+
+// converts an image to 8 bit if this is lossless
+/*
+src:     input image
+dst:     8-bit image
+return:  true if src is 8 bit or contains only integers in [0, 255]
+*/
+static bool lossless8U(const Mat &src, Mat &dst)
+{
+	if (src.depth() == CV_8U)
+	{
+		dst = src;
+		return true;
+	}
+	if (src.depth() != CV_32F)
+		return false;
+	for (int i = 0; i < src.rows; i++)
+	{
+		const float *data = src.ptr<float>(i);
+		for (int j = 0; j < src.cols; j++)
+			if (!(data[j] >= 0 && data[j] <= 255 && data[j] == (float)(int)data[j]))
+				return false;
+	}
+	src.convertTo(dst, CV_8U);
+	return true;
+}
+
+// the median filter
+/*
+src:     input image (CV_8UC1 or CV_32FC1)
+kSize:   window size used by median operation
+return:  filtered image
+*/
+Mat Dip2::medianFilter(Mat &src, int kSize)
+{
+	int r = kSize / 2;
+	Mat dst(src.rows, src.cols, CV_32FC1);
+	Mat src8U, padded;
+
+	// 8-bit images (also if stored as float, e.g. loaded and converted) can use the histogram engines
+	MedianEngine engine = medianEngine(lossless8U(src, src8U) ? CV_8U : src.depth(), kSize);
+	switch (engine)
+	{
+	case MEDIAN_NETWORK:
+		if (src8U.empty())
+			copyMakeBorder(src, padded, r, r, r, r, BORDER_REPLICATE);
+		else
+			copyMakeBorder(src8U, padded, r, r, r, r, BORDER_REPLICATE);
+		if (kSize == 3)
+			medianNetworkEngine<3>(padded.depth())(padded, dst);
+		else
+			medianNetworkEngine<5>(padded.depth())(padded, dst);
+		break;
+	case MEDIAN_HUANG:
+		copyMakeBorder(src8U, padded, r, r, r, r, BORDER_REPLICATE);
+		medianHuang(padded, dst, kSize);
+		break;
+	case MEDIAN_PERREAULT:
+		copyMakeBorder(src8U, padded, r, r, r, r, BORDER_REPLICATE);
+		medianPerreault(padded, dst, kSize);
+		break;
+	default:
+		if (src.depth() == CV_32F)
+			medianSort(src, dst, kSize);
+		else
+		{
+			Mat src32F;
+			src.convertTo(src32F, CV_32F);
+			medianSort(src32F, dst, kSize);
+		}
+	}
 
 	return dst;
 }
 
+// bilateral filter engines
+// weight of a neighbour = spatial kernel * range weight, the range weight is looked up in a table
+// indexed by the quantized absolute intensity difference
+
+// table entries per grey value; 8-bit images (integer differences) are looked up without error
+static const float BILATERAL_LUT_STEPS = 4;
+
+// standard-deviation of the radiometric kernel if none is given (sigma <= 0)
+static const double BILATERAL_DEFAULT_SIGMA = 20;
+
+// bilateral filter of the pixels [j0, j1) of row i, window positions outside the image are clamped
+/*
+src:      input image
+spatial:  spatial kernel
+lut:      range weights
+dst:      output image
+*/
+static void bilateralBorder(const Mat &src, const Mat &spatial, const float *lut, Mat &dst, int i, int j0, int j1)
+{
+	int r = spatial.rows / 2;
+	float *dst_data = dst.ptr<float>(i);
+	for (int j = j0; j < j1; j++)
+	{
+		float centre = src.at<float>(i, j);
+		float temp = 0, Z = 0; //Z: Normalizing constant
+		for (int m = 0; m < spatial.rows; m++)
+		{
+			const float *data = src.ptr<float>(std::min(std::max(i + m - r, 0), src.rows - 1));
+			const float *sk_data = spatial.ptr<float>(m);
+			for (int n = 0; n < spatial.cols; n++)
+			{
+				float value = data[std::min(std::max(j + n - r, 0), src.cols - 1)];
+				float weight = sk_data[n] * lut[(int)(std::abs(value - centre) * BILATERAL_LUT_STEPS + 0.5f)];
+				Z += weight;
+				temp += weight * value;
+			}
+		}
+		dst_data[j] = temp / Z;
+	}
+}
+
+// bilateral filter of the pixels [j0, j1) of row i, the window has to be inside the image
+static void bilateralInterior(const Mat &src, const Mat &spatial, const float *lut, Mat &dst, int i, int j0, int j1)
+{
+	int r = spatial.rows / 2;
+	float *dst_data = dst.ptr<float>(i);
+	for (int j = j0; j < j1; j++)
+	{
+		float centre = src.at<float>(i, j);
+		float temp = 0, Z = 0;
+		for (int m = 0; m < spatial.rows; m++)
+		{
+			const float *data = src.ptr<float>(i + m - r) + j - r;
+			const float *sk_data = spatial.ptr<float>(m);
+			for (int n = 0; n < spatial.cols; n++)
+			{
+				float weight = sk_data[n] * lut[(int)(std::abs(data[n] - centre) * BILATERAL_LUT_STEPS + 0.5f)];
+				Z += weight;
+				temp += weight * data[n];
+			}
+		}
+		dst_data[j] = temp / Z;
+	}
+}
+
+#ifdef DIP2_X86_ENGINES
+// 8 output pixels at once, the range weights are gathered from the table
+__attribute__((target("avx2,fma"))) static void bilateralInteriorAVX2(const Mat &src, const Mat &spatial, const float *lut, Mat &dst, int i, int j0, int j1)
+{
+	int r = spatial.rows / 2;
+	const __m256 steps = _mm256_set1_ps(BILATERAL_LUT_STEPS);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 sign = _mm256_set1_ps(-0.f);
+	float *dst_data = dst.ptr<float>(i);
+	int j = j0;
+	for (; j + 8 <= j1; j += 8)
+	{
+		__m256 centre = _mm256_loadu_ps(src.ptr<float>(i) + j);
+		__m256 temp = _mm256_setzero_ps(), Z = _mm256_setzero_ps();
+		for (int m = 0; m < spatial.rows; m++)
+		{
+			const float *data = src.ptr<float>(i + m - r) + j - r;
+			const float *sk_data = spatial.ptr<float>(m);
+			for (int n = 0; n < spatial.cols; n++)
+			{
+				__m256 value = _mm256_loadu_ps(data + n);
+				__m256 difference = _mm256_andnot_ps(sign, _mm256_sub_ps(value, centre));
+				// truncation of difference * steps + 0.5 as in the scalar version
+				__m256i index = _mm256_cvttps_epi32(_mm256_fmadd_ps(difference, steps, half));
+				__m256 weight = _mm256_mul_ps(_mm256_set1_ps(sk_data[n]), _mm256_i32gather_ps(lut, index, 4));
+				Z = _mm256_add_ps(Z, weight);
+				temp = _mm256_fmadd_ps(weight, value, temp);
+			}
+		}
+		_mm256_storeu_ps(dst_data + j, _mm256_div_ps(temp, Z));
+	}
+	bilateralInterior(src, spatial, lut, dst, i, j, j1);
+}
+#endif
+
+typedef void (*BilateralRows)(const Mat &, const Mat &, const float *, Mat &, int, int, int);
+
+// the interior engine, chosen once at runtime
+static BilateralRows bilateralEngine(void)
+{
+#ifdef DIP2_X86_ENGINES
+	static BilateralRows engine = checkHardwareSupport(CV_CPU_AVX2) && checkHardwareSupport(CV_CPU_FMA3) ? bilateralInteriorAVX2 : bilateralInterior;
+	return engine;
+#else
+	return bilateralInterior;
+#endif
+}
+
 // the bilateral filter
 /*
 src:     input image
 kSize:   size of the kernel --> used to compute std-dev of spatial kernel
-sigma:   standard-deviation of the radiometric kernel
+sigma:   standard-deviation of the radiometric kernel, <= 0: BILATERAL_DEFAULT_SIGMA
 return:  filtered image
 */
 Mat Dip2::bilateralFilter(Mat &src, int kSize, double sigma)
 {
+	if (sigma <= 0)
+		sigma = BILATERAL_DEFAULT_SIGMA;
 	int r = kSize / 2;
 	int rows = src.rows;
 	int cols = src.cols;
-	double sigma_space = -0.1; //(float)-4.5 / (r * r); //choose sigma = r/3: 3 sigma principle
+	double sigma_space = r > 0 ? -4.5 / (r * r) : 0; //choose sigma = r/3: 3 sigma principle
 	double sigma_color = -0.5 / (sigma * sigma);
 	Mat dst(rows, cols, CV_32FC1);
-	Mat src_padding(rows + kSize - 1, cols + kSize - 1, CV_32FC1);
-	copyMakeBorder(src, src_padding, r, r, r, r, BORDER_REPLICATE);
 
 	int i, j;
-	Mat spatial_kernel(kSize, kSize, CV_32FC1);
+	Mat spatial_kernel(2 * r + 1, 2 * r + 1, CV_32FC1);
 	for (i = -r; i < r + 1; i++)
 	{
 		float *sk_data = spatial_kernel.ptr<float>(i + r);
@@ -207,39 +1031,281 @@ Mat Dip2::bilateralFilter(Mat &src, int kSize, double sigma)
 		}
 	}
 
-	int m, n, count = 0;
-	float exp, temp, Z, weight_max = 0; //Z: Normalizing constant
+	// range weights up to the largest difference in the image
+	double minVal, maxVal;
+	minMaxLoc(src, &minVal, &maxVal);
+	vector<float> lut((int)((maxVal - minVal) * BILATERAL_LUT_STEPS + 0.5f) + 1);
+	for (size_t k = 0; k < lut.size(); k++)
+	{
+		double difference = k / BILATERAL_LUT_STEPS;
+		lut[k] = (float)std::exp(difference * difference * sigma_color);
+	}
+
+	// pixels closer than r to the border clamp their window, the others are vectorized
+	BilateralRows interior = bilateralEngine();
 	for (i = 0; i < rows; i++)
 	{
+		if (i < r || i >= rows - r || cols <= 2 * r)
+		{
+			bilateralBorder(src, spatial_kernel, &lut[0], dst, i, 0, cols);
+			continue;
+		}
+		bilateralBorder(src, spatial_kernel, &lut[0], dst, i, 0, r);
+		interior(src, spatial_kernel, &lut[0], dst, i, r, cols - r);
+		bilateralBorder(src, spatial_kernel, &lut[0], dst, i, cols - r, cols);
+	}
+
+	return dst;
+}
+
+// blurs a grid of (weighted sum, weight) pairs along one axis
+/*
+grid:    cells, 2 floats each
+tmp:     buffer of the same size
+size:    number of cells along the axis
+stride:  distance of neighbouring cells along the axis (in cells)
+lines:   first cell of every line along the axis
+kernel:  1D kernel, odd size
+*/
+static void blurGridAxis(vector<float> &grid, vector<float> &tmp, int size, int stride, const vector<int> &lines, const vector<float> &kernel)
+{
+	int r = (int)kernel.size() / 2;
+	for (size_t l = 0; l < lines.size(); l++)
+	{
+		const float *in = &grid[2 * lines[l]];
+		float *out = &tmp[2 * lines[l]];
+		for (int k = 0; k < size; k++)
+		{
+			float sum = 0, weight = 0;
+			// cells outside the grid are empty
+			for (int n = std::max(-r, -k); n <= std::min(r, size - 1 - k); n++)
+			{
+				sum += kernel[n + r] * in[2 * (k + n) * stride];
+				weight += kernel[n + r] * in[2 * (k + n) * stride + 1];
+			}
+			out[2 * k * stride] = sum;
+			out[2 * k * stride + 1] = weight;
+		}
+	}
+	grid.swap(tmp);
+}
+
+// approximation of the bilateral filter by a bilateral grid (Paris and Durand)
+// every pixel is splatted into the cell of its position and intensity, the grid is blurred
+// separably, and the result is sliced out by trilinear interpolation at the pixel's position and intensity
+// the cost does not depend on the spatial radius; the cell sizes (sigma * sampling) define the memory
+// of the grid: (cols / spatial cell) * (rows / spatial cell) * (intensity range / range cell) cells
+/*
+src:              input image
+kSize:            size of the kernel --> used to compute std-dev of spatial kernel, as in bilateralFilter
+sigma:            standard-deviation of the radiometric kernel, <= 0: BILATERAL_DEFAULT_SIGMA
+spatialSampling:  spatial cell size in units of the spatial std-dev (> 0), larger: coarser and faster
+rangeSampling:    range cell size in units of the radiometric std-dev (> 0), larger: coarser and faster
+return:           filtered image
+*/
+Mat Dip2::bilateralGrid(Mat &src, int kSize, double sigma, double spatialSampling, double rangeSampling)
+{
+	// the cell sizes divide positions and intensities
+	CV_Assert(spatialSampling > 0 && rangeSampling > 0);
+	if (sigma <= 0)
+		sigma = BILATERAL_DEFAULT_SIGMA;
+	int rows = src.rows;
+	int cols = src.cols;
+	double sigma_space = std::max(kSize / 2 / 3., 0.5); //sigma = r/3 as in bilateralFilter
+	double cellSpace = sigma_space * spatialSampling;
+	double cellRange = sigma * rangeSampling;
+
+	// the blur in cells corresponds to std-dev sigma_space and sigma in pixels and grey values
+	vector<float> kernelSpace, kernelRange;
+	double sigmaCells[2] = {1. / spatialSampling, 1. / rangeSampling};
+	vector<float> *kernels[2] = {&kernelSpace, &kernelRange};
+	for (int k = 0; k < 2; k++)
+	{
+		int r = std::max((int)std::ceil(2 * sigmaCells[k]), 1);
+		for (int n = -r; n <= r; n++)
+			kernels[k]->push_back((float)std::exp(-0.5 * n * n / (sigmaCells[k] * sigmaCells[k])));
+	}
+	int padSpace = (int)kernelSpace.size() / 2;
+	int padRange = (int)kernelRange.size() / 2;
+
+	double minVal, maxVal;
+	minMaxLoc(src, &minVal, &maxVal);
+	int width = (int)((cols - 1) / cellSpace) + 2 + 2 * padSpace;
+	int height = (int)((rows - 1) / cellSpace) + 2 + 2 * padSpace;
+	int depth = (int)((maxVal - minVal) / cellRange) + 2 + 2 * padRange;
+	vector<float> grid(2 * (size_t)width * height * depth, 0), tmp(grid.size());
+
+	// splat: nearest cell
+	for (int i = 0; i < rows; i++)
+	{
+		const float *data = src.ptr<float>(i);
+		int y = (int)(i / cellSpace + 0.5) + padSpace;
+		for (int j = 0; j < cols; j++)
+		{
+			int x = (int)(j / cellSpace + 0.5) + padSpace;
+			int z = (int)((data[j] - minVal) / cellRange + 0.5) + padRange;
+			float *cell = &grid[2 * (((size_t)z * height + y) * width + x)];
+			cell[0] += data[j];
+			cell[1] += 1;
+		}
+	}
+
+	// blur along x, y and intensity
+	vector<int> lines;
+	for (int z = 0; z < depth; z++)
+		for (int y = 0; y < height; y++)
+			lines.push_back((z * height + y) * width);
+	blurGridAxis(grid, tmp, width, 1, lines, kernelSpace);
+	lines.clear();
+	for (int z = 0; z < depth; z++)
+		for (int x = 0; x < width; x++)
+			lines.push_back(z * height * width + x);
+	blurGridAxis(grid, tmp, height, width, lines, kernelSpace);
+	lines.clear();
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			lines.push_back(y * width + x);
+	blurGridAxis(grid, tmp, depth, width * height, lines, kernelRange);
+
+	// slice: trilinear interpolation
+	Mat dst(rows, cols, CV_32FC1);
+	size_t planeStep = 2 * (size_t)width * height;
+	for (int i = 0; i < rows; i++)
+	{
+		const float *data = src.ptr<float>(i);
 		float *dst_data = dst.ptr<float>(i);
-		const float *_data = src.ptr<float>(i);
-		for (j = 0; j < cols; j++)
+		double fy = i / cellSpace + padSpace;
+		int y = (int)fy;
+		double wy = fy - y;
+		for (int j = 0; j < cols; j++)
 		{
+			double fx = j / cellSpace + padSpace;
+			double fz = (data[j] - minVal) / cellRange + padRange;
+			int x = (int)fx, z = (int)fz;
+			double wx = fx - x, wz = fz - z;
+			const float *cell = &grid[2 * (((size_t)z * height + y) * width + x)];
+			double sum = 0, weight = 0;
+			for (int c = 0; c < 8; c++)
+			{
+				int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+				double w = (dx ? wx : 1 - wx) * (dy ? wy : 1 - wy) * (dz ? wz : 1 - wz);
+				const float *corner = cell + dz * planeStep + 2 * (dy * width + dx);
+				sum += w * corner[0];
+				weight += w * corner[1];
+			}
+			dst_data[j] = weight > 0 ? (float)(sum / weight) : data[j];
+		}
+	}
 
-			for (m = 0; m < kSize; m++)
+	return dst;
+}
+
+// block size for comparison in the non-local means filter
+static const int NLM_BLOCK_SIZE = 5;
+// image rows processed together by one thread
+static const int NLM_BAND_ROWS = 32;
+
+// weights exp(-x) are looked up in a table for x < NLM_EXP_CUTOFF (exp(-20) = 2e-9) and are 0 beyond
+static const int NLM_EXP_CUTOFF = 20;
+static const int NLM_EXP_STEPS = 256; // table entries per unit of x
+// pre-selection skips block pairs whose weight is known to be below exp(-NLM_PRESELECT_CUTOFF) (0.011)
+static const double NLM_PRESELECT_CUTOFF = 4.5;
+
+// everything the search offsets of one filter call share
+struct NlmSetup
+{
+	Mat padded;          // source image, padded by r + NLM_BLOCK_SIZE / 2 on every side
+	int r;               // half search size
+	double scale;        // weight = exp(-block distance * scale)
+	vector<float> lut;   // exp(-x) for x = k / NLM_EXP_STEPS
+	bool preselect;      // skip block pairs by comparing block mean and deviation first
+	Mat mean, deviation; // block statistics, indexed by the top-left position of the block in padded
+};
+
+// adds the contribution of one search offset to the non-local means sums (Darbon et al.)
+// the squared differences between the image and its shifted copy are summed up in an integral image,
+// so the distance of every block pair is read with 4 lookups
+// block pairs with negligible weight are skipped: after the distance (cutoff of the weight table) or,
+// with pre-selection, before it, since mean distance >= (mean difference)^2 + (deviation difference)^2
+/*
+setup:       filter parameters
+dy, dx:      search offset
+row0:        first image row of the band
+integral:    buffer, (band rows + NLM_BLOCK_SIZE) x (cols + NLM_BLOCK_SIZE), CV_64FC1
+Z:           sum of weights of every pixel of the band
+sum:         weighted sum of every pixel of the band
+statistics:  counts compared and skipped block pairs
+*/
+static void nlmOffset(const NlmSetup &setup, int dy, int dx, int row0, Mat &integral, Mat &Z, Mat &sum, NlmStatistics &statistics)
+{
+	const Mat &padded = setup.padded;
+	int rows = Z.rows;
+	int cols = Z.cols;
+	int r = setup.r;
+	int _r = NLM_BLOCK_SIZE / 2;
+	double scale = setup.scale / (NLM_BLOCK_SIZE * NLM_BLOCK_SIZE);
+	const float *lut = &setup.lut[0];
+	float preselectThreshold = (float)(NLM_PRESELECT_CUTOFF / setup.scale);
+	int64 cutoff = 0, preselected = 0;
+
+	// integral image of the squared differences over the blocks of all pixels
+	for (int y = 0; y < rows + NLM_BLOCK_SIZE - 1; y++)
+	{
+		const float *data = padded.ptr<float>(row0 + y + r) + r;
+		const float *shifted = padded.ptr<float>(row0 + y + r + dy) + r + dx;
+		const double *above = integral.ptr<double>(y);
+		double *integral_data = integral.ptr<double>(y + 1);
+		double rowSum = 0;
+		for (int x = 0; x < cols + NLM_BLOCK_SIZE - 1; x++)
+		{
+			double difference = data[x] - shifted[x];
+			rowSum += difference * difference;
+			integral_data[x + 1] = above[x + 1] + rowSum;
+		}
+	}
+
+	for (int i = 0; i < rows; i++)
+	{
+		const double *top = integral.ptr<double>(i);
+		const double *bottom = integral.ptr<double>(i + NLM_BLOCK_SIZE);
+		const float *candidate = padded.ptr<float>(row0 + i + r + _r + dy) + r + _r + dx;
+		float *Z_data = Z.ptr<float>(i);
+		float *sum_data = sum.ptr<float>(i);
+		const float *mean = 0, *deviation = 0, *mean_shifted = 0, *deviation_shifted = 0;
+		if (setup.preselect)
+		{
+			mean = setup.mean.ptr<float>(row0 + i + r) + r;
+			deviation = setup.deviation.ptr<float>(row0 + i + r) + r;
+			mean_shifted = setup.mean.ptr<float>(row0 + i + r + dy) + r + dx;
+			deviation_shifted = setup.deviation.ptr<float>(row0 + i + r + dy) + r + dx;
+		}
+		for (int j = 0; j < cols; j++)
+		{
+			if (setup.preselect)
 			{
-				const float *data = src_padding.ptr<float>(i + m);
-				data += j;
-				const float *sk_data = spatial_kernel.ptr<float>(m);
-				for (n = 0; n < kSize; n++)
+				float meanDifference = mean[j] - mean_shifted[j];
+				float deviationDifference = deviation[j] - deviation_shifted[j];
+				if (meanDifference * meanDifference + deviationDifference * deviationDifference > preselectThreshold)
 				{
-					exp = std::exp((*data - *_data) * (*data - *_data) * sigma_color);
-					/*if (exp == 1)
-						exp = weight_max;
-					else if(exp > weight_max)
-						weight_max = exp;*/
-					Z += (*sk_data) * exp;
-					temp += (*data++) * (*sk_data++) * exp;
+					preselected++;
+					continue;
 				}
 			}
-			*dst_data++ = (float)temp / Z;
-			_data++;
-			temp = 0;
-			Z = 0;
+			double x = (bottom[j + NLM_BLOCK_SIZE] - bottom[j] - top[j + NLM_BLOCK_SIZE] + top[j]) * scale;
+			if (x >= NLM_EXP_CUTOFF)
+			{
+				cutoff++;
+				continue;
+			}
+			float weight = lut[(int)(x * NLM_EXP_STEPS + 0.5)];
+			Z_data[j] += weight;
+			sum_data[j] += weight * candidate[j];
 		}
 	}
 
-	return dst;
+	statistics.candidates += (int64)rows * cols;
+	statistics.cutoff += cutoff;
+	statistics.preselected += preselected;
 }
 
 // the non-local means filter
@@ -247,9 +1313,100 @@ Mat Dip2::bilateralFilter(Mat &src, int kSize, double sigma)
 src:   		input image
 searchSize: size of search region
 sigma: 		Optional parameter for weighting function
+preselect:  skip dissimilar blocks by comparing their mean and deviation first (Mahmoudi and Sapiro)
+statistics: (optional) counts compared and skipped block pairs
 return:  	filtered image
 */
-Mat Dip2::nlmFilter(Mat &src, int searchSize, double sigma)
+Mat Dip2::nlmFilter(Mat &src, int searchSize, double sigma, bool preselect, NlmStatistics *statistics)
+{
+	int rows = src.rows;
+	int cols = src.cols;
+	int r = searchSize / 2;
+	int _r = NLM_BLOCK_SIZE / 2;
+
+	NlmSetup setup;
+	setup.r = r;
+	setup.scale = 0.5 / (sigma * sigma);
+	setup.preselect = preselect;
+	copyMakeBorder(src, setup.padded, r + _r, r + _r, r + _r, r + _r, BORDER_REPLICATE);
+	setup.lut.resize(NLM_EXP_CUTOFF * NLM_EXP_STEPS + 1);
+	for (size_t k = 0; k < setup.lut.size(); k++)
+		setup.lut[k] = (float)std::exp(-(double)k / NLM_EXP_STEPS);
+
+	if (preselect)
+	{
+		// mean and standard deviation of every block by integral images
+		Mat squared, integralSum, integralSquared;
+		multiply(setup.padded, setup.padded, squared);
+		integral(setup.padded, integralSum, CV_64F);
+		integral(squared, integralSquared, CV_64F);
+		int n = NLM_BLOCK_SIZE * NLM_BLOCK_SIZE;
+		setup.mean.create(setup.padded.rows - NLM_BLOCK_SIZE + 1, setup.padded.cols - NLM_BLOCK_SIZE + 1, CV_32FC1);
+		setup.deviation.create(setup.mean.size(), CV_32FC1);
+		for (int i = 0; i < setup.mean.rows; i++)
+		{
+			for (int j = 0; j < setup.mean.cols; j++)
+			{
+				double blockSum = integralSum.at<double>(i + NLM_BLOCK_SIZE, j + NLM_BLOCK_SIZE) - integralSum.at<double>(i + NLM_BLOCK_SIZE, j) - integralSum.at<double>(i, j + NLM_BLOCK_SIZE) + integralSum.at<double>(i, j);
+				double blockSquared = integralSquared.at<double>(i + NLM_BLOCK_SIZE, j + NLM_BLOCK_SIZE) - integralSquared.at<double>(i + NLM_BLOCK_SIZE, j) - integralSquared.at<double>(i, j + NLM_BLOCK_SIZE) + integralSquared.at<double>(i, j);
+				double mean = blockSum / n;
+				setup.mean.at<float>(i, j) = (float)mean;
+				setup.deviation.at<float>(i, j) = (float)std::sqrt(std::max(blockSquared / n - mean * mean, 0.));
+			}
+		}
+	}
+
+	// the image is split into bands of rows, every thread takes one contiguous range of bands (nstripes = threads)
+	// and allocates its buffers once for all of them; every band adds all search offsets in the same order,
+	// so the result does not depend on the number of threads or the scheduling
+	Mat dst(rows, cols, CV_32FC1);
+	NlmStatistics total;
+	std::mutex totalMutex;
+	int bands = (rows + NLM_BAND_ROWS - 1) / NLM_BAND_ROWS;
+	parallel_for_(Range(0, bands), [&](const Range &range) {
+		Mat integral(NLM_BAND_ROWS + NLM_BLOCK_SIZE, cols + NLM_BLOCK_SIZE, CV_64FC1, Scalar::all(0));
+		Mat Z(NLM_BAND_ROWS, cols, CV_32FC1); //Z: Normalizing constant
+		Mat sum(NLM_BAND_ROWS, cols, CV_32FC1);
+		NlmStatistics counts;
+		for (int band = range.start; band < range.end; band++)
+		{
+			int row0 = band * NLM_BAND_ROWS;
+			int bandRows = std::min(NLM_BAND_ROWS, rows - row0);
+			Mat bandZ = Z.rowRange(0, bandRows), bandSum = sum.rowRange(0, bandRows);
+			bandZ.setTo(0);
+			bandSum.setTo(0);
+			for (int dy = -r; dy < searchSize - r; dy++)
+				for (int dx = -r; dx < searchSize - r; dx++)
+					nlmOffset(setup, dy, dx, row0, integral, bandZ, bandSum, counts);
+
+			for (int i = 0; i < bandRows; i++)
+			{
+				const float *Z_data = bandZ.ptr<float>(i);
+				const float *sum_data = bandSum.ptr<float>(i);
+				float *dst_data = dst.ptr<float>(row0 + i);
+				for (int j = 0; j < cols; j++)
+					dst_data[j] = sum_data[j] / Z_data[j];
+			}
+		}
+		std::lock_guard<std::mutex> lock(totalMutex);
+		total.candidates += counts.candidates;
+		total.cutoff += counts.cutoff;
+		total.preselected += counts.preselected;
+	}, std::max(getNumThreads(), 1));
+
+	if (statistics)
+		*statistics = total;
+	return dst;
+}
+
+// straightforward non-local means filter, reference for the faster one
+/*
+src:   		input image
+searchSize: size of search region
+sigma: 		Optional parameter for weighting function
+return:  	filtered image
+*/
+Mat Dip2::nlmFilterNaive(Mat &src, int searchSize, double sigma)
 {
 	int blockSize = 5; //Block for comparision
 	int rows = src.rows;
@@ -297,23 +1454,398 @@ Mat Dip2::nlmFilter(Mat &src, int searchSize, double sigma)
 			/*weight.at<float>(r, r) = weight_max; //The weight of central point in the search zone (i , j)
 			Z -= 1 - weight_max;*/
 
-			for (m = 0; m < searchSize; m++) //Compute the final output
+			for (m = 0; m < searchSize; m++) //Compute the final output
+			{
+				const float *weight_data = weight.ptr<float>(m);
+				const float *src_data = src_padding.ptr<float>(i + _r + m);
+				src_data += j + _r;
+				for (n = 0; n < searchSize; n++)
+				{
+					*dst_data += (*weight_data++) * (*src_data++);
+				}
+			}
+			*dst_data++ /= Z;
+		}
+	}
+
+	return dst;
+}
+
+// rows around an output row that a filter reads, -1 if the filter is not local
+/*
+method:  name of noise reduction method, as in Dip2::noiseReduction(...)
+kSize:   (spatial) kernel size
+*/
+static int streamHalo(const string &method, int kSize)
+{
+	if (method.compare("average") == 0 || method.compare("median") == 0 || method.compare("bilateral") == 0)
+		return kSize / 2;
+	if (method.compare("nlm") == 0)
+		return kSize / 2 + NLM_BLOCK_SIZE / 2;
+	// the bilateral grid is binned by the intensity range of the whole image
+	return -1;
+}
+
+// noise reduction of an image that is streamed from file to file in strips of rows
+// the image never is in memory as a whole: every strip is filtered together with the halo rows around it,
+// the 2 x halo rows (kSize - 1 for the windowed filters) shared with the next strip are kept in the window
+// near the top and bottom of the image the window is clipped, so the filters handle the border as for the whole image
+// memory therefore depends on the number of columns and the strip height, but not on the image height
+/*
+input:     raw 8-bit grayscale image, rows x cols bytes in row-major order without header
+output:    raw 8-bit grayscale image of the same size, filtered and rounded
+rows:      image height
+cols:      image width
+method:    name of noise reduction method: "average", "median", "bilateral" or "nlm"
+kSize:     (spatial) kernel size
+param:     see Dip2::noiseReduction(...)
+stripRows: number of output rows per strip
+return:    false if the method cannot be streamed or the files cannot be accessed
+*/
+bool Dip2::streamFilter(string input, string output, int rows, int cols, string method, int kSize, double param, int stripRows)
+{
+	int halo = streamHalo(method, kSize);
+	if (halo < 0)
+	{
+		cout << "ERROR: Dip2::streamFilter(): " << method << " cannot be streamed" << endl;
+		return false;
+	}
+	ifstream in(input.c_str(), ios::in | ios::binary);
+	ofstream out(output.c_str(), ios::out | ios::binary);
+	if (!in || !out)
+	{
+		cout << "ERROR: Dip2::streamFilter(): cannot open " << (!in ? input : output) << endl;
+		return false;
+	}
+
+	// rows [first, next) of the image are in the window
+	Mat window(stripRows + 2 * halo, cols, CV_32FC1);
+	vector<uchar> line(cols);
+	int first = 0, next = 0;
+	for (int y0 = 0; y0 < rows; y0 += stripRows)
+	{
+		int y1 = std::min(y0 + stripRows, rows);
+		int top = std::max(y0 - halo, 0);
+		int bottom = std::min(y1 + halo, rows);
+
+		// keep the rows shared with the last strip, read the others
+		if (top > first)
+		{
+			for (int i = top; i < next; i++)
+				window.row(i - first).copyTo(window.row(i - top));
+			first = top;
+		}
+		for (; next < bottom; next++)
+		{
+			in.read((char *)&line[0], cols);
+			if (!in)
+			{
+				cout << "ERROR: Dip2::streamFilter(): " << input << " has less than " << rows << " rows" << endl;
+				return false;
+			}
+			float *window_data = window.ptr<float>(next - first);
+			for (int j = 0; j < cols; j++)
+				window_data[j] = line[j];
+		}
+
+		Mat strip = window.rowRange(0, bottom - first);
+		Mat filtered = noiseReduction(strip, method, kSize, param);
+		for (int i = y0; i < y1; i++)
+		{
+			const float *filtered_data = filtered.ptr<float>(i - first);
+			for (int j = 0; j < cols; j++)
+				line[j] = saturate_cast<uchar>(filtered_data[j]);
+			out.write((const char *)&line[0], cols);
+		}
+	}
+
+	return (bool)out;
+}
+
+// noise synthesis
+// every pixel takes its random numbers from a counter-based generator (Philox4x32-10, Salmon et al. 2011):
+// they are a function of (seed, noise type, image index, pixel index) only, so an image is reproduced
+// from its seed, and any number of threads can generate it in any order with the same result
+// noise is added and the result is rounded in the same pass
+
+// Philox4x32 multipliers and key increments
+static const unsigned PHILOX_M0 = 0xD2511F53, PHILOX_M1 = 0xCD9E8D57;
+static const unsigned PHILOX_W0 = 0x9E3779B9, PHILOX_W1 = 0xBB67AE85;
+static const int PHILOX_ROUNDS = 10;
+// pixels per block of random numbers
+static const int NOISE_LANES = 8;
+// rows per task of the parallel loop
+static const int NOISE_BAND_ROWS = 16;
+// Poisson noise is sampled exactly (inversion) below this mean, by the normal approximation above
+static const double NOISE_POISSON_EXACT = 64;
+
+// Philox4x32-10 bijection of one counter
+/*
+ctr:     counter, replaced by the 4 random words
+k0, k1:  key
+*/
+static inline void philox(unsigned ctr[4], unsigned k0, unsigned k1)
+{
+	for (int r = 0; r < PHILOX_ROUNDS; r++)
+	{
+		uint64 p0 = (uint64)PHILOX_M0 * ctr[0];
+		uint64 p1 = (uint64)PHILOX_M1 * ctr[2];
+		unsigned c0 = (unsigned)(p1 >> 32) ^ ctr[1] ^ k0;
+		unsigned c2 = (unsigned)(p0 >> 32) ^ ctr[3] ^ k1;
+		ctr[0] = c0;
+		ctr[1] = (unsigned)p1;
+		ctr[2] = c2;
+		ctr[3] = (unsigned)p0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+}
+
+// random words of NOISE_LANES consecutive pixels
+/*
+pixel:   index of the first pixel (row * cols + col)
+stream:  third and fourth counter word (image index and noise type)
+k0, k1:  key (seed)
+out:     out[w][lane] is word w of pixel + lane
+*/
+static void philoxBlockScalar(uint64 pixel, const unsigned stream[2], unsigned k0, unsigned k1, unsigned out[4][NOISE_LANES])
+{
+	for (int lane = 0; lane < NOISE_LANES; lane++)
+	{
+		unsigned ctr[4] = {(unsigned)(pixel + lane), (unsigned)((pixel + lane) >> 32), stream[0], stream[1]};
+		philox(ctr, k0, k1);
+		for (int w = 0; w < 4; w++)
+			out[w][lane] = ctr[w];
+	}
+}
+
+#ifdef DIP2_X86_ENGINES
+// low and high 32 bits of the products of 8 words with a constant
+__attribute__((target("avx2"))) static inline void mulhilo(__m256i a, __m256i m, __m256i &lo, __m256i &hi)
+{
+	__m256i even = _mm256_mul_epu32(a, m);
+	__m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+	lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+	hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// 8 counters per vector, one word of every counter per register
+__attribute__((target("avx2"))) static void philoxBlockAVX2(uint64 pixel, const unsigned stream[2], unsigned k0, unsigned k1, unsigned out[4][NOISE_LANES])
+{
+	__m256i low = _mm256_add_epi64(_mm256_set1_epi64x(pixel), _mm256_setr_epi64x(0, 1, 2, 3));
+	__m256i high = _mm256_add_epi64(low, _mm256_set1_epi64x(4));
+	// low words of the pixel indices in order, then the high words
+	__m256i order = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m256i a = _mm256_permutevar8x32_epi32(low, order), b = _mm256_permutevar8x32_epi32(high, order);
+	__m256i c0 = _mm256_permute2x128_si256(a, b, 0x20);
+	__m256i c1 = _mm256_permute2x128_si256(a, b, 0x31);
+	__m256i c2 = _mm256_set1_epi32(stream[0]);
+	__m256i c3 = _mm256_set1_epi32(stream[1]);
+	__m256i m0 = _mm256_set1_epi32(PHILOX_M0), m1 = _mm256_set1_epi32(PHILOX_M1);
+	for (int r = 0; r < PHILOX_ROUNDS; r++)
+	{
+		__m256i lo0, hi0, lo1, hi1;
+		mulhilo(c0, m0, lo0, hi0);
+		mulhilo(c2, m1, lo1, hi1);
+		c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(k0));
+		c1 = lo1;
+		c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(k1));
+		c3 = lo0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	_mm256_storeu_si256((__m256i *)out[0], c0);
+	_mm256_storeu_si256((__m256i *)out[1], c1);
+	_mm256_storeu_si256((__m256i *)out[2], c2);
+	_mm256_storeu_si256((__m256i *)out[3], c3);
+}
+#endif
+
+typedef void (*PhiloxBlock)(uint64, const unsigned[2], unsigned, unsigned, unsigned[4][NOISE_LANES]);
+
+// the block generator used by addNoise, chosen once at runtime
+static PhiloxBlock philoxBlock(void)
+{
+#ifdef DIP2_X86_ENGINES
+	static PhiloxBlock block = checkHardwareSupport(CV_CPU_AVX2) ? philoxBlockAVX2 : philoxBlockScalar;
+	return block;
+#else
+	return philoxBlockScalar;
+#endif
+}
+
+// uniform number in (0, 1) from a random word
+static inline double uniform(unsigned r)
+{
+	return (r + 0.5) * (1. / 4294967296.);
+}
+
+// standard normal number from two random words (Box-Muller)
+static inline double normal(unsigned r0, unsigned r1)
+{
+	return std::sqrt(-2 * std::log(uniform(r0))) * std::cos(2 * CV_PI * uniform(r1));
+}
+
+// noisy grey value of one pixel
+/*
+x:      noise-free grey value
+level:  noise parameter, see Dip2::addNoise(...)
+r:      the 4 random words of the pixel
+*/
+template <int TYPE>
+static inline double noisyValue(double x, double level, const unsigned r[4])
+{
+	switch (TYPE)
+	{
+	case NOISE_SALT_PEPPER:
+	{
+		double u = uniform(r[0]);
+		return u < level ? 0 : (u >= 1 - level ? 255 : x);
+	}
+	case NOISE_GAUSSIAN:
+		return x + level * normal(r[0], r[1]);
+	case NOISE_POISSON:
+	{
+		// level photons per grey value
+		double lambda = std::max(x, 0.) * level;
+		if (lambda >= NOISE_POISSON_EXACT)
+			return (lambda + std::sqrt(lambda) * normal(r[0], r[1])) / level;
+		// inversion of the cumulative distribution, 53 bit uniform number
+		double u = (r[2] + (r[3] >> 11) * (1. / 2097152.)) * (1. / 4294967296.);
+		double p = std::exp(-lambda), cdf = p;
+		int k = 0;
+		while (u > cdf && p > 0)
+		{
+			k++;
+			p *= lambda / k;
+			cdf += p;
+		}
+		return k / level;
+	}
+	default: // NOISE_SPECKLE
+		return x * (1 + level * normal(r[0], r[1]));
+	}
+}
+
+// adds noise to rows [row0, row1)
+/*
+src:     input image (SrcT)
+dst:     output image (CV_8UC1)
+level:   noise parameter
+stream:  image index and noise type
+k0, k1:  key (seed)
+*/
+template <int TYPE, typename SrcT>
+static void noiseRows(const Mat &src, Mat &dst, double level, const unsigned stream[2], unsigned k0, unsigned k1, int row0, int row1)
+{
+	PhiloxBlock block = philoxBlock();
+	unsigned words[4][NOISE_LANES];
+	for (int i = row0; i < row1; i++)
+	{
+		const SrcT *src_data = src.ptr<SrcT>(i);
+		uchar *dst_data = dst.ptr<uchar>(i);
+		for (int j = 0; j < src.cols; j += NOISE_LANES)
+		{
+			block((uint64)i * src.cols + j, stream, k0, k1, words);
+			int lanes = std::min(NOISE_LANES, src.cols - j);
+			for (int lane = 0; lane < lanes; lane++)
 			{
-				const float *weight_data = weight.ptr<float>(m);
-				const float *src_data = src_padding.ptr<float>(i + _r + m);
-				src_data += j + _r;
-				for (n = 0; n < searchSize; n++)
-				{
-					*dst_data += (*weight_data++) * (*src_data++);
-				}
+				unsigned r[4] = {words[0][lane], words[1][lane], words[2][lane], words[3][lane]};
+				dst_data[j + lane] = saturate_cast<uchar>(noisyValue<TYPE>(src_data[j + lane], level, r));
 			}
-			*dst_data++ /= Z;
 		}
 	}
+}
+
+template <int TYPE>
+static void noiseRows(const Mat &src, Mat &dst, double level, const unsigned stream[2], unsigned k0, unsigned k1, int row0, int row1)
+{
+	if (src.depth() == CV_8U)
+		noiseRows<TYPE, uchar>(src, dst, level, stream, k0, k1, row0, row1);
+	else
+		noiseRows<TYPE, float>(src, dst, level, stream, k0, k1, row0, row1);
+}
 
+// adds synthetic noise to an image
+/*
+src:    input image (CV_8UC1 or CV_32FC1, grey values in [0, 255])
+type:   NOISE_SALT_PEPPER: level = probability of black and of white pixels (each)
+        NOISE_GAUSSIAN: level = standard deviation
+        NOISE_POISSON: level = photons per grey value, i.e. value = Poisson(x * level) / level
+        NOISE_SPECKLE: level = standard deviation of the multiplicative noise, i.e. value = x * (1 + level * N(0, 1))
+level:  noise parameter
+seed:   seed of the random numbers
+index:  index of the image, images of the same seed and different index have independent noise
+return: noisy image (CV_8UC1, rounded and saturated)
+*/
+Mat Dip2::addNoise(const Mat &src, NoiseType type, double level, uint64 seed, unsigned index)
+{
+	Mat dst(src.rows, src.cols, CV_8UC1);
+	unsigned stream[2] = {index, (unsigned)type};
+	unsigned k0 = (unsigned)seed, k1 = (unsigned)(seed >> 32);
+	int bands = (src.rows + NOISE_BAND_ROWS - 1) / NOISE_BAND_ROWS;
+	parallel_for_(Range(0, bands), [&](const Range &range) {
+		int row0 = range.start * NOISE_BAND_ROWS;
+		int row1 = std::min(range.end * NOISE_BAND_ROWS, src.rows);
+		switch (type)
+		{
+		case NOISE_SALT_PEPPER:
+			noiseRows<NOISE_SALT_PEPPER>(src, dst, level, stream, k0, k1, row0, row1);
+			break;
+		case NOISE_GAUSSIAN:
+			noiseRows<NOISE_GAUSSIAN>(src, dst, level, stream, k0, k1, row0, row1);
+			break;
+		case NOISE_POISSON:
+			noiseRows<NOISE_POISSON>(src, dst, level, stream, k0, k1, row0, row1);
+			break;
+		default:
+			noiseRows<NOISE_SPECKLE>(src, dst, level, stream, k0, k1, row0, row1);
+		}
+	});
 	return dst;
 }
 
+// noise types and levels of the benchmark corpus
+static const NoiseType CORPUS_TYPES[] = {NOISE_SALT_PEPPER, NOISE_GAUSSIAN, NOISE_POISSON, NOISE_SPECKLE};
+static const char *CORPUS_NAMES[] = {"saltpepper", "gaussian", "poisson", "speckle"};
+static const double CORPUS_LEVELS[] = {0.15, 50, 0.25, 0.2};
+
+// writes a corpus of noisy images for tests and benchmarks
+// every image is written losslessly (png) and listed in outdir/corpus.csv with its parameters
+/*
+fname:   path to the original image
+outdir:  output directory (must exist)
+count:   number of images per noise type
+seed:    seed of the random numbers, the same seed reproduces the corpus
+return:  false if the original cannot be read or an image cannot be written
+*/
+bool Dip2::generateNoiseCorpus(string fname, string outdir, int count, uint64 seed)
+{
+	Mat img = imread(fname, 0);
+	if (!img.data)
+	{
+		cout << "ERROR: Dip2::generateNoiseCorpus(): file " << fname << " not found" << endl;
+		return false;
+	}
+
+	fstream list((outdir + "/corpus.csv").c_str(), ios::out);
+	list << "file,type,level,seed,index" << endl;
+	for (int t = 0; t < 4; t++)
+	{
+		for (int index = 0; index < count; index++)
+		{
+			string name = string(CORPUS_NAMES[t]) + "_" + to_string(index) + ".png";
+			if (!imwrite(outdir + "/" + name, addNoise(img, CORPUS_TYPES[t], CORPUS_LEVELS[t], seed, index)))
+			{
+				cout << "ERROR: Dip2::generateNoiseCorpus(): cannot write " << outdir << "/" << name << endl;
+				return false;
+			}
+			list << name << "," << CORPUS_NAMES[t] << "," << CORPUS_LEVELS[t] << "," << seed << "," << index << endl;
+		}
+	}
+	return true;
+}
+
 /* *****************************
   GIVEN FUNCTIONS
 ***************************** */
@@ -332,7 +1864,6 @@ void Dip2::run(void)
 		cin.get();
 		exit(-3);
 	}
-	noise1.convertTo(noise1, CV_32FC1);
 	Mat noise2 = imread("noiseType_2.jpg", 0);
 	if (!noise2.data)
 	{
@@ -341,7 +1872,6 @@ void Dip2::run(void)
 		cin.get();
 		exit(-3);
 	}
-	noise2.convertTo(noise2, CV_32FC1);
 	cout << "done" << endl;
 
 	// apply noise reduction
@@ -369,20 +1899,26 @@ void Dip2::run(void)
 
 // noise reduction
 /*
-src:     input image
+src:     input image (CV_8UC1 or CV_32FC1)
 method:  name of noise reduction method that shall be performed
 	     "average" ==> moving average
          "median" ==> median filter
          "bilateral" ==> bilateral filter
+         "bilateralgrid" ==> bilateral filter approximated by a bilateral grid (for large kernels)
          "nlm" ==> non-local means filter
 kSize:   (spatial) kernel size
-param:   if method == "bilateral", standard-deviation of radiometric kernel; if method == "nlm", (optional) parameter for similarity function
+param:   if method == "bilateral" or "bilateralgrid", standard-deviation of radiometric kernel (<= 0: 20); if method == "nlm", (optional) parameter for similarity function
          can be ignored otherwise (default value = 0)
 return:  output image
 */
 Mat Dip2::noiseReduction(Mat &src, string method, int kSize, double param)
 {
 
+	// average and median filter 8-bit images directly, the other filters work on float
+	Mat src32F = src;
+	if (src.depth() != CV_32F && method.compare("average") != 0 && method.compare("median") != 0)
+		src.convertTo(src32F, CV_32FC1);
+
 	// apply moving average filter
 	if (method.compare("average") == 0)
 	{
@@ -396,12 +1932,17 @@ Mat Dip2::noiseReduction(Mat &src, string method, int kSize, double param)
 	// apply bilateral filter
 	if (method.compare("bilateral") == 0)
 	{
-		return bilateralFilter(src, kSize, param);
+		return bilateralFilter(src32F, kSize, param);
+	}
+	// apply approximated bilateral filter
+	if (method.compare("bilateralgrid") == 0)
+	{
+		return bilateralGrid(src32F, kSize, param);
 	}
 	// apply adaptive average filter
 	if (method.compare("nlm") == 0)
 	{
-		return nlmFilter(src, kSize, param);
+		return nlmFilter(src32F, kSize, param);
 	}
 
 	// if none of above, throw warning and return copy of original
@@ -429,8 +1970,6 @@ void Dip2::generateNoisyImages(string fname)
 		exit(-3);
 	}
 
-	// convert to floating point precision
-	img.convertTo(img, CV_32FC1);
 	cout << "done" << endl;
 
 	// save original
@@ -439,41 +1978,304 @@ void Dip2::generateNoisyImages(string fname)
 	// generate images with different types of noise
 	cout << "generate noisy images" << endl;
 
-	// some temporary images
-	Mat tmp1(img.rows, img.cols, CV_32FC1);
-	Mat tmp2(img.rows, img.cols, CV_32FC1);
 	// first noise operation - Shot Noise
-	float noiseLevel = 0.15;
-	randu(tmp1, 0, 1);
-	threshold(tmp1, tmp2, noiseLevel, 1, CV_THRESH_BINARY);
-	multiply(tmp2, img, tmp2);
-	threshold(tmp1, tmp1, 1 - noiseLevel, 1, CV_THRESH_BINARY);
-	tmp1 *= 255;
-	tmp1 = tmp2 + tmp1;
-	threshold(tmp1, tmp1, 255, 255, CV_THRESH_TRUNC);
+	// noise is reproducible from the seed (0)
 	// save image
-	imwrite("noiseType_1.jpg", tmp1);
+	imwrite("noiseType_1.jpg", addNoise(img, NOISE_SALT_PEPPER, 0.15, 0));
 
 	// second noise operation - Gaussian Noise
-	noiseLevel = 50;
-	randn(tmp1, 0, noiseLevel);
-	tmp1 = img + tmp1;
-	threshold(tmp1, tmp1, 255, 255, CV_THRESH_TRUNC);
-	threshold(tmp1, tmp1, 0, 0, CV_THRESH_TOZERO);
 	// save image
-	imwrite("noiseType_2.jpg", tmp1);
+	imwrite("noiseType_2.jpg", addNoise(img, NOISE_GAUSSIAN, 50, 0));
 
 	cout << "done" << endl;
 	cout << "Please run now: dip2 restorate" << endl;
 }
 
+// measures the convolution engines against the straightforward convolution
+// results are printed and written to "spatialConvolution.txt"
+void Dip2::benchmark(void)
+{
+
+	Mat img(1024, 1024, CV_32FC1);
+	randu(img, 0, 255);
+	vector<const ConvolutionEngine *> engines = convolutionEngines();
+	cout << "convolution engine: " << convolutionEngine().name << endl;
+
+	fstream file("spatialConvolution.txt", ios::out);
+	file << "kSize naive";
+	for (size_t e = 0; e < engines.size(); e++)
+		file << " " << engines[e]->name;
+	file << endl;
+	for (int kSize = 3; kSize <= 31; kSize += 2)
+	{
+		Mat kernel(kSize, kSize, CV_32FC1);
+		randu(kernel, 0, 1);
+		kernel /= sum(kernel).val[0];
+
+		int64 time = getTickCount();
+		Mat ref = spatialConvolutionNaive(img, kernel);
+		double timeNaive = (getTickCount() - time) * 1000 / getTickFrequency();
+		cout << "kSize " << kSize << ": naive " << timeNaive << "ms";
+		file << kSize << " " << timeNaive;
+
+		int r = (kSize - 1) / 2;
+		Mat padded, flipped, dst(img.rows, img.cols, CV_32FC1);
+		copyMakeBorder(img, padded, r, r, r, r, BORDER_REPLICATE);
+		flip(kernel, flipped, -1);
+		for (size_t e = 0; e < engines.size(); e++)
+		{
+			time = getTickCount();
+			convolve2D(padded, flipped, dst, *engines[e]);
+			double timeEngine = (getTickCount() - time) * 1000 / getTickFrequency();
+			cout << ", " << engines[e]->name << " " << timeEngine << "ms (max. error " << norm(dst, ref, NORM_INF) << ")";
+			file << " " << timeEngine;
+		}
+		cout << endl;
+		file << endl;
+	}
+	file.close();
+
+	// moving average: running sums vs. convolution with a constant kernel
+	for (int kSize = 3; kSize <= 31; kSize += 4)
+	{
+		Mat kernel(kSize, kSize, CV_32FC1, Scalar::all(1. / (kSize * kSize)));
+		int64 time = getTickCount();
+		Mat ref = spatialConvolutionNaive(img, kernel);
+		double timeConvolution = (getTickCount() - time) * 1000 / getTickFrequency();
+		time = getTickCount();
+		Mat dst = averageFilter(img, kSize);
+		double timeAverage = (getTickCount() - time) * 1000 / getTickFrequency();
+		cout << "average kSize " << kSize << ": convolution " << timeConvolution << "ms, running sums " << timeAverage << "ms (max. error " << norm(dst, ref, NORM_INF) << ")" << endl;
+	}
+
+	// median engines on 8-bit values
+	Mat img8U, img8U32F;
+	img.convertTo(img8U, CV_8U);
+	img8U.convertTo(img8U32F, CV_32F);
+	for (int kSize = 3; kSize <= 31; kSize += 2)
+	{
+		int r = kSize / 2;
+		Mat padded, dst(img.rows, img.cols, CV_32FC1);
+		copyMakeBorder(img8U, padded, r, r, r, r, BORDER_REPLICATE);
+		cout << "median kSize " << kSize << ":";
+		if (kSize <= 5)
+		{
+			int64 time = getTickCount();
+			(kSize == 3 ? medianNetworkEngine<3>(CV_8U) : medianNetworkEngine<5>(CV_8U))(padded, dst);
+			cout << " network " << (getTickCount() - time) * 1000 / getTickFrequency() << "ms,";
+		}
+		if (kSize <= 11)
+		{
+			int64 time = getTickCount();
+			medianSort(img8U32F, dst, kSize);
+			cout << " sort " << (getTickCount() - time) * 1000 / getTickFrequency() << "ms,";
+		}
+		int64 time = getTickCount();
+		medianHuang(padded, dst, kSize);
+		cout << " huang " << (getTickCount() - time) * 1000 / getTickFrequency() << "ms,";
+		time = getTickCount();
+		medianPerreault(padded, dst, kSize);
+		cout << " perreault " << (getTickCount() - time) * 1000 / getTickFrequency() << "ms" << endl;
+	}
+
+	// sorting networks vs. sorting on a 4K frame
+	Mat frame(2160, 3840, CV_32FC1), frame8U;
+	randu(frame, 0, 255);
+	frame.convertTo(frame8U, CV_8U);
+	for (int kSize = 3; kSize <= 5; kSize += 2)
+	{
+		int r = kSize / 2;
+		Mat padded, padded8U, frame8U32F, dst(frame.rows, frame.cols, CV_32FC1);
+		copyMakeBorder(frame, padded, r, r, r, r, BORDER_REPLICATE);
+		copyMakeBorder(frame8U, padded8U, r, r, r, r, BORDER_REPLICATE);
+		frame8U.convertTo(frame8U32F, CV_32F);
+
+		int64 time = getTickCount();
+		medianSort(frame8U32F, dst, kSize);
+		double timeSort = (getTickCount() - time) * 1000 / getTickFrequency();
+		time = getTickCount();
+		(kSize == 3 ? medianNetworkEngine<3>(CV_32F) : medianNetworkEngine<5>(CV_32F))(padded, dst);
+		double timeFloat = (getTickCount() - time) * 1000 / getTickFrequency();
+		time = getTickCount();
+		(kSize == 3 ? medianNetworkEngine<3>(CV_8U) : medianNetworkEngine<5>(CV_8U))(padded8U, dst);
+		double time8U = (getTickCount() - time) * 1000 / getTickFrequency();
+		cout << "median 4K kSize " << kSize << ": sort " << timeSort << "ms, network float " << timeFloat << "ms (x" << timeSort / timeFloat
+			 << "), network 8 bit " << time8U << "ms (x" << timeSort / time8U << ")" << endl;
+	}
+
+	// bilateral grid: error vs. speed against the exact filter
+	// results are written to "bilateralGrid.txt"
+	Mat smooth = img(Rect(0, 0, 512, 512)).clone();
+	GaussianBlur(smooth, smooth, Size(9, 9), 3);
+	fstream gridFile("bilateralGrid.txt", ios::out);
+	gridFile << "kSize sampling exact_ms grid_ms rms_error max_error" << endl;
+	for (int kSize = 11; kSize <= 41; kSize += 10)
+	{
+		int64 time = getTickCount();
+		Mat ref = bilateralFilter(smooth, kSize, 20);
+		double timeExact = (getTickCount() - time) * 1000 / getTickFrequency();
+		double samplings[] = {0.5, 1, 2, 4};
+		for (int k = 0; k < 4; k++)
+		{
+			time = getTickCount();
+			Mat dst = bilateralGrid(smooth, kSize, 20, samplings[k], samplings[k]);
+			double timeGrid = (getTickCount() - time) * 1000 / getTickFrequency();
+			double rms = norm(dst, ref, NORM_L2) / std::sqrt((double)dst.total());
+			double maxError = norm(dst, ref, NORM_INF);
+			cout << "bilateral kSize " << kSize << " sampling " << samplings[k] << ": exact " << timeExact << "ms, grid " << timeGrid << "ms (rms error " << rms << ", max. error " << maxError << ")" << endl;
+			gridFile << kSize << " " << samplings[k] << " " << timeExact << " " << timeGrid << " " << rms << " " << maxError << endl;
+		}
+	}
+	gridFile.close();
+
+	// non-local means: integral images vs. block distances from scratch
+	Mat small = img(Rect(0, 0, 128, 128)).clone();
+	for (int searchSize = 5; searchSize <= 21; searchSize += 8)
+	{
+		int64 time = getTickCount();
+		Mat ref = nlmFilterNaive(small, searchSize, 24);
+		double timeNaive = (getTickCount() - time) * 1000 / getTickFrequency();
+		time = getTickCount();
+		Mat dst = nlmFilter(small, searchSize, 24);
+		double timeIntegral = (getTickCount() - time) * 1000 / getTickFrequency();
+		cout << "nlm searchSize " << searchSize << " (128x128): naive " << timeNaive << "ms, integral images " << timeIntegral << "ms (max. error " << norm(dst, ref, NORM_INF) << ")" << endl;
+	}
+	// scaling with the number of threads
+	Mat half = img(Rect(0, 0, 512, 512)).clone();
+	Mat serial;
+	double timeSerial = 0;
+	int threads[] = {1, 2, 4, 8, 16};
+	for (int t = 0; t < 5; t++)
+	{
+		setNumThreads(threads[t]);
+		int64 time = getTickCount();
+		Mat dst = nlmFilter(half, 35, 24);
+		double timeThreads = (getTickCount() - time) * 1000 / getTickFrequency();
+		if (t == 0)
+		{
+			serial = dst;
+			timeSerial = timeThreads;
+		}
+		cout << "nlm searchSize 35 (512x512), " << threads[t] << " threads: " << timeThreads << "ms (speedup " << timeSerial / timeThreads << ", max. difference to 1 thread " << norm(dst, serial, NORM_INF) << ")" << endl;
+	}
+	setNumThreads(-1);
+
+	// skipped block pairs: weight table cutoff and pre-selection by block mean and deviation
+	Mat noisy = imread("noiseType_2.jpg", 0);
+	string name = "noiseType_2.jpg";
+	if (!noisy.data)
+	{
+		noisy = half;
+		name = "512x512";
+	}
+	noisy.convertTo(noisy, CV_32FC1);
+	bool preselect[] = {false, true};
+	double timeCutoff = 0;
+	Mat cutoffOnly;
+	for (int p = 0; p < 2; p++)
+	{
+		NlmStatistics statistics;
+		int64 time = getTickCount();
+		Mat dst = nlmFilter(noisy, 35, 24, preselect[p], &statistics);
+		double timeNlm = (getTickCount() - time) * 1000 / getTickFrequency();
+		if (p == 0)
+		{
+			cutoffOnly = dst;
+			timeCutoff = timeNlm;
+		}
+		cout << "nlm searchSize 35 (" << name << "), pre-selection " << (preselect[p] ? "on" : "off") << ": " << timeNlm << "ms (speedup " << timeCutoff / timeNlm
+			 << ", " << statistics.candidates << " block pairs, " << statistics.cutoff << " cut off, " << statistics.preselected << " pre-selected, max. difference " << norm(dst, cutoffOnly, NORM_INF) << ")" << endl;
+	}
+
+	// streaming in strips vs. filtering the whole image
+	Mat tall(8192, 1024, CV_8UC1);
+	randu(tall, 0, 256);
+	ofstream rawFile("benchmark_input.raw", ios::out | ios::binary);
+	for (int i = 0; i < tall.rows; i++)
+		rawFile.write((const char *)tall.ptr<uchar>(i), tall.cols);
+	rawFile.close();
+	string streamed[] = {"average", "median", "bilateral"};
+	for (int k = 0; k < 3; k++)
+	{
+		int64 time = getTickCount();
+		Mat tall32F, result;
+		tall.convertTo(tall32F, CV_32FC1);
+		noiseReduction(tall32F, streamed[k], 5, 20).convertTo(result, CV_8UC1);
+		double timeWhole = (getTickCount() - time) * 1000 / getTickFrequency();
+		time = getTickCount();
+		streamFilter("benchmark_input.raw", "benchmark_output.raw", tall.rows, tall.cols, streamed[k], 5, 20);
+		double timeStream = (getTickCount() - time) * 1000 / getTickFrequency();
+		cout << streamed[k] << " 5x5 (" << tall.cols << "x" << tall.rows << "): whole image " << timeWhole << "ms, streamed " << timeStream << "ms (window of " << 256 + 4 << " instead of " << tall.rows << " rows)" << endl;
+	}
+	std::remove("benchmark_input.raw");
+	std::remove("benchmark_output.raw");
+
+	// native 8-bit and 16-bit paths vs. float: same work per pixel, less memory traffic
+	// bandwidth counts reading the source and writing the result once
+	Mat gaussian = getGaussianKernel(5, 1, CV_32F) * getGaussianKernel(5, 1, CV_32F).t();
+	Mat box = Mat::ones(5, 5, CV_32FC1) / 25;
+	int depths[] = {CV_8U, CV_16U, CV_32F};
+	const char *depthNames[] = {"8U", "16U", "32F"};
+	for (int d = 0; d < 3; d++)
+	{
+		Mat native;
+		img.convertTo(native, depths[d]);
+		double megapixels = native.total() / 1e6;
+		double bytes = 2. * native.total() * native.elemSize();
+		Mat kernels[] = {gaussian, box};
+		const char *kernelNames[] = {"gaussian", "box"};
+		for (int k = 0; k < 2; k++)
+		{
+			int64 time = getTickCount();
+			spatialConvolution(native, kernels[k]);
+			double timeConvolution = (getTickCount() - time) / getTickFrequency();
+			cout << "convolution 5x5 " << kernelNames[k] << " " << depthNames[d] << ": " << timeConvolution * 1000 << "ms (" << megapixels / timeConvolution << " MPixel/s, " << bytes / timeConvolution / 1e6 << " MB/s)" << endl;
+		}
+		int64 time = getTickCount();
+		averageFilter(native, 5);
+		double timeAverage = (getTickCount() - time) / getTickFrequency();
+		cout << "average 5x5 " << depthNames[d] << ": " << timeAverage * 1000 << "ms (" << megapixels / timeAverage << " MPixel/s, " << bytes / timeAverage / 1e6 << " MB/s)" << endl;
+	}
+
+	// noise synthesis: former threshold pipeline on float images vs. fused counter-based generator
+	double megapixels = img.total() / 1e6;
+	int64 time = getTickCount();
+	Mat floatImg, tmp1(img.rows, img.cols, CV_32FC1), tmp2(img.rows, img.cols, CV_32FC1);
+	img.convertTo(floatImg, CV_32FC1);
+	randu(tmp1, 0, 1);
+	threshold(tmp1, tmp2, 0.15, 1, CV_THRESH_BINARY);
+	multiply(tmp2, floatImg, tmp2);
+	threshold(tmp1, tmp1, 1 - 0.15, 1, CV_THRESH_BINARY);
+	tmp1 *= 255;
+	tmp1 = tmp2 + tmp1;
+	threshold(tmp1, tmp1, 255, 255, CV_THRESH_TRUNC);
+	double timeThreshold = (getTickCount() - time) / getTickFrequency();
+	cout << "salt and pepper noise, threshold pipeline: " << timeThreshold * 1000 << "ms (" << megapixels / timeThreshold << " MPixel/s)" << endl;
+	for (int t = 0; t < 4; t++)
+	{
+		time = getTickCount();
+		addNoise(img, CORPUS_TYPES[t], CORPUS_LEVELS[t], 0);
+		double timeNoise = (getTickCount() - time) / getTickFrequency();
+		cout << CORPUS_NAMES[t] << " noise: " << timeNoise * 1000 << "ms (" << megapixels / timeNoise << " MPixel/s)" << endl;
+	}
+}
+
 // function calls some basic testing routines to test individual functions for correctness
 void Dip2::test(void)
 {
 
 	test_spatialConvolution();
+	test_convolutionEngines();
+	test_separableConvolution();
 	test_averageFilter();
 	test_medianFilter();
+	test_medianEngines();
+	test_bilateralFilter();
+	test_bilateralGrid();
+	test_nlmFilter();
+	test_streamFilter();
+	test_fixedPoint();
+	test_addNoise();
 
 	cout << "Press enter to continue" << endl;
 	cin.get();
@@ -553,6 +2355,394 @@ void Dip2::test_spatialConvolution(void)
 	cout << "Message: Dip2::spatialConvolution() seems to be correct" << endl;
 }
 
+// compares all convolution engines supported by this CPU with the straightforward convolution
+void Dip2::test_convolutionEngines(void)
+{
+
+	vector<const ConvolutionEngine *> engines = convolutionEngines();
+	int kSizes[] = {1, 3, 5, 9, 15};
+	for (int k = 0; k < 5; k++)
+	{
+		// odd image size to cover remaining rows and columns
+		Mat input(37, 53, CV_32FC1);
+		randu(input, 0, 255);
+		Mat kernel(kSizes[k], kSizes[k], CV_32FC1);
+		randu(kernel, -1, 1);
+		kernel /= kSizes[k] * kSizes[k];
+
+		Mat ref = spatialConvolutionNaive(input, kernel);
+		int r = (kSizes[k] - 1) / 2;
+		Mat padded, flipped, output(input.rows, input.cols, CV_32FC1);
+		copyMakeBorder(input, padded, r, r, r, r, BORDER_REPLICATE);
+		flip(kernel, flipped, -1);
+		for (size_t e = 0; e < engines.size(); e++)
+		{
+			convolve2D(padded, flipped, output, *engines[e]);
+			if (norm(output, ref, NORM_INF) > 1e-5 * std::max(1., norm(ref, NORM_INF)))
+			{
+				cout << "ERROR: Dip2::spatialConvolution(): " << engines[e]->name << " engine differs from reference for kSize " << kSizes[k] << endl;
+				return;
+			}
+		}
+	}
+	cout << "Message: Dip2::spatialConvolution() engines seem to be correct" << endl;
+}
+
+// compares the separable convolution of low-rank kernels with the straightforward convolution
+void Dip2::test_separableConvolution(void)
+{
+
+	Mat input(41, 29, CV_32FC1);
+	randu(input, 0, 255);
+	// rank 1, rank 2 and (most likely) full rank kernels
+	Mat a(7, 1, CV_32FC1), b(1, 7, CV_32FC1), c(7, 1, CV_32FC1), d(1, 7, CV_32FC1);
+	randu(a, -1, 1);
+	randu(b, -1, 1);
+	randu(c, -1, 1);
+	randu(d, -1, 1);
+	Mat kernels[3] = {Mat(a * b), Mat(a * b + c * d), Mat(7, 7, CV_32FC1)};
+	randu(kernels[2], -1, 1);
+	for (int k = 0; k < 3; k++)
+	{
+		kernels[k] /= 49;
+		Mat ref = spatialConvolutionNaive(input, kernels[k]);
+		// second call uses the cached decomposition
+		for (int n = 0; n < 2; n++)
+		{
+			Mat output = spatialConvolution(input, kernels[k]);
+			if (norm(output, ref, NORM_INF) > 1e-5 * std::max(1., norm(ref, NORM_INF)))
+			{
+				cout << "ERROR: Dip2::spatialConvolution(): Separable convolution of rank " << k + 1 << " kernel contains wrong values!" << endl;
+				return;
+			}
+		}
+	}
+	cout << "Message: Dip2::spatialConvolution() separable convolution seems to be correct" << endl;
+}
+
+// compares the histogram median engines with sorting
+void Dip2::test_medianEngines(void)
+{
+
+	int kSizes[] = {3, 5, 7, 15, 31, 61};
+	for (int k = 0; k < 6; k++)
+	{
+		int r = kSizes[k] / 2;
+		// few grey values to get many equal values in a window
+		Mat input(47, 39, CV_8UC1), input32F, padded;
+		randu(input, 0, k % 2 ? 256 : 8);
+		input.convertTo(input32F, CV_32FC1);
+		copyMakeBorder(input, padded, r, r, r, r, BORDER_REPLICATE);
+
+		Mat ref(input.size(), CV_32FC1), huang(input.size(), CV_32FC1), perreault(input.size(), CV_32FC1);
+		medianSort(input32F, ref, kSizes[k]);
+		medianHuang(padded, huang, kSizes[k]);
+		medianPerreault(padded, perreault, kSizes[k]);
+		if (norm(huang, ref, NORM_INF) > 0 || norm(perreault, ref, NORM_INF) > 0)
+		{
+			cout << "ERROR: Dip2::medianFilter(): Histogram median differs from sorting for kSize " << kSizes[k] << endl;
+			return;
+		}
+	}
+
+	// sorting networks, every instruction set supported by the CPU, 8 bit and float
+	for (int kSize = 3; kSize <= 5; kSize += 2)
+	{
+		int r = kSize / 2;
+		// width not divisible by the vector widths to cover the remaining columns
+		Mat input(23, 71, CV_32FC1), input8U, padded, padded8U;
+		randu(input, 0, 255);
+		input.convertTo(input8U, CV_8U);
+		copyMakeBorder(input, padded, r, r, r, r, BORDER_REPLICATE);
+		copyMakeBorder(input8U, padded8U, r, r, r, r, BORDER_REPLICATE);
+
+		vector<MedianRows> engines;
+		vector<Mat> inputs;
+		engines.push_back(kSize == 3 ? medianNetwork<NetworkScalar<float>, 3> : medianNetwork<NetworkScalar<float>, 5>);
+		engines.push_back(kSize == 3 ? medianNetwork<NetworkScalar<uchar>, 3> : medianNetwork<NetworkScalar<uchar>, 5>);
+		engines.push_back(kSize == 3 ? medianNetworkEngine<3>(CV_32F) : medianNetworkEngine<5>(CV_32F));
+		engines.push_back(kSize == 3 ? medianNetworkEngine<3>(CV_8U) : medianNetworkEngine<5>(CV_8U));
+		Mat ref(input.size(), CV_32FC1), ref8U(input.size(), CV_32FC1), output(input.size(), CV_32FC1), input8U32F;
+		input8U.convertTo(input8U32F, CV_32F);
+		medianSort(input, ref, kSize);
+		medianSort(input8U32F, ref8U, kSize);
+		for (size_t e = 0; e < engines.size(); e++)
+		{
+			engines[e](e % 2 ? padded8U : padded, output);
+			if (norm(output, e % 2 ? ref8U : ref, NORM_INF) > 0)
+			{
+				cout << "ERROR: Dip2::medianFilter(): Sorting network differs from sorting for kSize " << kSize << endl;
+				return;
+			}
+		}
+	}
+	cout << "Message: Dip2::medianFilter() histogram engines and sorting networks seem to be correct" << endl;
+}
+
+// compares the bilateral filter with a double precision reference without lookup table
+void Dip2::test_bilateralFilter(void)
+{
+
+	Mat input(31, 45, CV_32FC1);
+	randu(input, 0, 255);
+	// integer grey values as loaded images, the range table is exact for them
+	input.convertTo(input, CV_8U);
+	input.convertTo(input, CV_32F);
+	int kSizes[] = {1, 3, 7, 15};
+	double sigmas[] = {10, 50};
+	for (int k = 0; k < 4; k++)
+	{
+		for (int s = 0; s < 2; s++)
+		{
+			int r = kSizes[k] / 2;
+			double sigma_space = r > 0 ? r / 3. : 1;
+			Mat output = bilateralFilter(input, kSizes[k], sigmas[s]);
+			for (int i = 0; i < input.rows; i++)
+			{
+				for (int j = 0; j < input.cols; j++)
+				{
+					double temp = 0, Z = 0, centre = input.at<float>(i, j);
+					for (int m = -r; m <= r; m++)
+					{
+						for (int n = -r; n <= r; n++)
+						{
+							double value = input.at<float>(std::min(std::max(i + m, 0), input.rows - 1), std::min(std::max(j + n, 0), input.cols - 1));
+							double weight = std::exp(-0.5 * (m * m + n * n) / (sigma_space * sigma_space) - 0.5 * (value - centre) * (value - centre) / (sigmas[s] * sigmas[s]));
+							Z += weight;
+							temp += weight * value;
+						}
+					}
+					if (abs(output.at<float>(i, j) - temp / Z) > 0.01)
+					{
+						cout << "ERROR: Dip2::bilateralFilter(): Result differs from reference at (" << i << ", " << j << ") for kSize " << kSizes[k] << endl;
+						return;
+					}
+				}
+			}
+		}
+	}
+	cout << "Message: Dip2::bilateralFilter() seems to be correct" << endl;
+}
+
+// checks that the bilateral grid smoothes flat regions, keeps edges and is close to the exact filter
+void Dip2::test_bilateralGrid(void)
+{
+
+	// two flat regions with noise, separated by a strong edge
+	Mat input(64, 64, CV_32FC1);
+	randn(input, 0, 5);
+	for (int i = 0; i < input.rows; i++)
+		for (int j = 0; j < input.cols; j++)
+			input.at<float>(i, j) += j < 32 ? 50 : 200;
+
+	Mat output = bilateralGrid(input, 15, 20);
+	Mat exact = bilateralFilter(input, 15, 20);
+	if ((input.cols != output.cols) || (input.rows != output.rows))
+	{
+		cout << "ERROR: Dip2::bilateralGrid(): input.size != output.size" << endl;
+		return;
+	}
+	if (abs(mean(output(Rect(0, 0, 30, 64))).val[0] - 50) > 2 || abs(mean(output(Rect(34, 0, 30, 64))).val[0] - 200) > 2)
+	{
+		cout << "ERROR: Dip2::bilateralGrid(): Edge is not preserved!" << endl;
+		return;
+	}
+	if (norm(output, exact, NORM_L2) / std::sqrt((double)output.total()) > 2)
+	{
+		cout << "ERROR: Dip2::bilateralGrid(): Result differs too much from the exact bilateral filter!" << endl;
+		return;
+	}
+	// noiseReduction(...) passes param = 0 if none is given
+	Mat defaulted = noiseReduction(input, "bilateralgrid", 15);
+	if (norm(defaulted, output, NORM_INF) != 0)
+	{
+		cout << "ERROR: Dip2::bilateralGrid(): sigma <= 0 does not use the default!" << endl;
+		return;
+	}
+	cout << "Message: Dip2::bilateralGrid() seems to be correct" << endl;
+}
+
+// compares the non-local means filter with the straightforward implementation
+void Dip2::test_nlmFilter(void)
+{
+
+	Mat input(29, 37, CV_32FC1);
+	randu(input, 0, 255);
+	GaussianBlur(input, input, Size(5, 5), 1);
+	// the weight table rounds the block distance to 1 / NLM_EXP_STEPS, weights are off by up to 0.2 percent
+	int searchSizes[] = {1, 5, 11};
+	for (int k = 0; k < 3; k++)
+	{
+		NlmStatistics statistics;
+		Mat output = nlmFilter(input, searchSizes[k], 24, false, &statistics);
+		Mat ref = nlmFilterNaive(input, searchSizes[k], 24);
+		if (norm(output, ref, NORM_INF) > 0.05)
+		{
+			cout << "ERROR: Dip2::nlmFilter(): Result differs from reference for searchSize " << searchSizes[k] << endl;
+			return;
+		}
+		if (statistics.candidates != (int64)input.total() * searchSizes[k] * searchSizes[k] || statistics.preselected != 0)
+		{
+			cout << "ERROR: Dip2::nlmFilter(): Wrong number of compared block pairs for searchSize " << searchSizes[k] << endl;
+			return;
+		}
+	}
+	// pre-selection only skips block pairs of small weight
+	NlmStatistics statistics;
+	Mat output = nlmFilter(input, 11, 24, true, &statistics);
+	Mat ref = nlmFilter(input, 11, 24);
+	if (statistics.preselected == 0 || norm(output, ref, NORM_INF) > 0.5)
+	{
+		cout << "ERROR: Dip2::nlmFilter(): Pre-selection changes the result" << endl;
+		return;
+	}
+	cout << "Message: Dip2::nlmFilter() seems to be correct" << endl;
+}
+
+// compares streamed filtering with filtering of the whole image
+void Dip2::test_streamFilter(void)
+{
+
+	Mat input(41, 23, CV_8UC1);
+	randu(input, 0, 256);
+	string inputName = "streamFilter_input.raw", outputName = "streamFilter_output.raw";
+	ofstream file(inputName.c_str(), ios::out | ios::binary);
+	for (int i = 0; i < input.rows; i++)
+		file.write((const char *)input.ptr<uchar>(i), input.cols);
+	file.close();
+	Mat input32F;
+	input.convertTo(input32F, CV_32FC1);
+
+	string methods[] = {"average", "median", "bilateral", "nlm"};
+	double params[] = {0, 0, 20, 24};
+	bool correct = true;
+	for (int k = 0; k < 4 && correct; k++)
+	{
+		// strips smaller and larger than the halo
+		for (int stripRows = 1; stripRows <= 16 && correct; stripRows *= 4)
+		{
+			Mat ref;
+			noiseReduction(input32F, methods[k], 5, params[k]).convertTo(ref, CV_8UC1);
+			Mat output(input.rows, input.cols, CV_8UC1);
+			correct = streamFilter(inputName, outputName, input.rows, input.cols, methods[k], 5, params[k], stripRows);
+			ifstream result(outputName.c_str(), ios::in | ios::binary);
+			for (int i = 0; i < output.rows; i++)
+				result.read((char *)output.ptr<uchar>(i), output.cols);
+			// the window sums of integer grey values are exact, so every method matches bit for bit
+			if (!correct || !result || norm(output, ref, NORM_INF) != 0)
+			{
+				cout << "ERROR: Dip2::streamFilter(): Result differs from whole image for " << methods[k] << " and " << stripRows << " rows per strip" << endl;
+				correct = false;
+			}
+		}
+	}
+	std::remove(inputName.c_str());
+	std::remove(outputName.c_str());
+	if (correct)
+		cout << "Message: Dip2::streamFilter() seems to be correct" << endl;
+}
+
+// compares the fixed-point paths for 8-bit and 16-bit images with the float ones
+void Dip2::test_fixedPoint(void)
+{
+
+	Mat gaussian = getGaussianKernel(5, 1.2, CV_32F) * getGaussianKernel(5, 1.2, CV_32F).t();
+	Mat laplacian = Mat::zeros(3, 3, CV_32FC1);
+	laplacian.at<float>(0, 1) = laplacian.at<float>(1, 0) = laplacian.at<float>(1, 2) = laplacian.at<float>(2, 1) = 1;
+	laplacian.at<float>(1, 1) = -4;
+	int depths[] = {CV_8U, CV_16U};
+	double maxValues[] = {255, 65535};
+	for (int d = 0; d < 2; d++)
+	{
+		Mat input(29, 37, CV_MAKETYPE(depths[d], 1)), input32F;
+		randu(input, 0, maxValues[d] + 1);
+		input.convertTo(input32F, CV_32FC1);
+
+		// integer results may be off by one where the float result is close to .5,
+		// Q15 weights are precise to about half a step of a 16-bit value
+		Mat output = spatialConvolution(input, gaussian), ref;
+		spatialConvolution(input32F, gaussian).convertTo(ref, depths[d]);
+		if (output.depth() != depths[d] || norm(output, ref, NORM_INF) > (depths[d] == CV_8U ? 1 : 4))
+		{
+			cout << "ERROR: Dip2::spatialConvolution(): Fixed-point result differs from float for depth " << depths[d] << endl;
+			return;
+		}
+		output = spatialConvolution(input, laplacian, CV_32F);
+		ref = spatialConvolution(input32F, laplacian);
+		if (output.depth() != CV_32F || norm(output, ref, NORM_INF) > 1e-3 * maxValues[d])
+		{
+			cout << "ERROR: Dip2::spatialConvolution(): Fixed-point result with float output differs for depth " << depths[d] << endl;
+			return;
+		}
+
+		output = averageFilter(input, 5);
+		averageFilter(input32F, 5).convertTo(ref, depths[d]);
+		if (output.depth() != depths[d] || norm(output, ref, NORM_INF) > 1)
+		{
+			cout << "ERROR: Dip2::averageFilter(): Integer result differs from float for depth " << depths[d] << endl;
+			return;
+		}
+	}
+	cout << "Message: Dip2 fixed-point paths seem to be correct" << endl;
+}
+
+// checks the random number generator and the statistics of the synthetic noise
+void Dip2::test_addNoise(void)
+{
+
+	// known answers of Philox4x32-10 (Random123)
+	unsigned zero[4] = {0, 0, 0, 0};
+	unsigned pi[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+	philox(zero, 0, 0);
+	philox(pi, 0xa4093822, 0x299f31d0);
+	if (zero[0] != 0x6627e8d5 || zero[3] != 0x9b00dbd8 || pi[0] != 0xd16cfe09 || pi[3] != 0x24126ea1)
+	{
+		cout << "ERROR: Dip2::addNoise(): Philox4x32-10 does not match the known answers" << endl;
+		return;
+	}
+	// the block generators agree
+	unsigned stream[2] = {7, 1}, scalar[4][NOISE_LANES], fast[4][NOISE_LANES];
+	philoxBlockScalar(0xfffffffcULL, stream, 1, 2, scalar);
+	philoxBlock()(0xfffffffcULL, stream, 1, 2, fast);
+	if (memcmp(scalar, fast, sizeof(scalar)) != 0)
+	{
+		cout << "ERROR: Dip2::addNoise(): Block generators differ" << endl;
+		return;
+	}
+
+	Mat constant(128, 100, CV_32FC1, Scalar(100));
+	// reproducible from the seed, independent of the number of threads, different for another index
+	Mat first = addNoise(constant, NOISE_GAUSSIAN, 20, 42, 3);
+	int threads = getNumThreads();
+	setNumThreads(1);
+	Mat serial = addNoise(constant, NOISE_GAUSSIAN, 20, 42, 3);
+	setNumThreads(threads);
+	if (norm(first, serial, NORM_INF) != 0 || norm(first, addNoise(constant, NOISE_GAUSSIAN, 20, 42, 4), NORM_INF) == 0)
+	{
+		cout << "ERROR: Dip2::addNoise(): Noise is not reproducible from the seed" << endl;
+		return;
+	}
+
+	// mean and standard deviation of every noise type on a constant image
+	NoiseType types[] = {NOISE_SALT_PEPPER, NOISE_GAUSSIAN, NOISE_POISSON, NOISE_POISSON, NOISE_SPECKLE};
+	double levels[] = {0.1, 20, 0.2, 1, 0.1};
+	double means[] = {0.1 * 255 + 0.8 * 100, 100, 100, 100, 100};
+	double deviations[] = {std::sqrt(0.1 * 255 * 255 + 0.8 * 100 * 100 - means[0] * means[0]), 20, std::sqrt(100 / 0.2), 10, 10};
+	for (int k = 0; k < 5; k++)
+	{
+		Mat noisy = addNoise(constant, types[k], levels[k], 1), noisy32F;
+		noisy.convertTo(noisy32F, CV_32F);
+		Mat mean, deviation;
+		meanStdDev(noisy32F, mean, deviation);
+		if (std::abs(mean.at<double>(0) - means[k]) > 0.5 + 0.02 * deviations[k] || std::abs(deviation.at<double>(0) - deviations[k]) > 0.5 + 0.03 * deviations[k])
+		{
+			cout << "ERROR: Dip2::addNoise(): Wrong statistics of noise type " << types[k] << " (mean " << mean.at<double>(0) << ", standard deviation " << deviation.at<double>(0) << ")" << endl;
+			return;
+		}
+	}
+	cout << "Message: Dip2::addNoise() seems to be correct" << endl;
+}
+
 // checks basic properties of the filtering result
 void Dip2::test_averageFilter(void)
 {
@@ -12,6 +12,25 @@
 using namespace std;
 using namespace cv;
 
+// number of block pairs compared and skipped by the non-local means filter
+struct NlmStatistics{
+   NlmStatistics(void) : candidates(0), cutoff(0), preselected(0){};
+   // compared block pairs (search offsets x pixels)
+   int64 candidates;
+   // skipped since the weight is below the smallest value of the weight table
+   int64 cutoff;
+   // skipped by the block mean and deviation test
+   int64 preselected;
+};
+
+// types of synthetic noise
+enum NoiseType{
+   NOISE_SALT_PEPPER,
+   NOISE_GAUSSIAN,
+   NOISE_POISSON,
+   NOISE_SPECKLE
+};
+
 class Dip2{
 
    public:
@@ -27,20 +46,35 @@ class Dip2{
       void run(void);
       // testing routine
       void test(void);
+      // measures processing time
+      void benchmark(void);
+      // adds synthetic noise, reproducible from seed and image index
+      Mat addNoise(const Mat& src, NoiseType type, double level, uint64 seed, unsigned index = 0);
+      // writes noisy versions of an image as png
+      bool generateNoiseCorpus(string fname, string outdir, int count, uint64 seed = 0);
+      // noise reduction of a raw 8-bit image streamed in strips of rows
+      bool streamFilter(string input, string output, int rows, int cols, string method, int kSize, double param = 0, int stripRows = 256);
 
    private:
       // function headers of functions to be implemented
       // --> please edit ONLY these functions!
       // performs spatial convolution of image and filter kernel
-      Mat spatialConvolution(Mat&, Mat&);
+      Mat spatialConvolution(Mat&, Mat&, int ddepth = -1);
       // moving average filter (aka box filter)
-      Mat averageFilter(Mat& src, int kSize);
+      Mat averageFilter(Mat& src, int kSize, int ddepth = -1);
       // median filter
       Mat medianFilter(Mat& src, int kSize);
       // bilateral filer
       Mat bilateralFilter(Mat& src, int kSize, double sigma);
+      // bilateral filter approximated by a bilateral grid
+      Mat bilateralGrid(Mat& src, int kSize, double sigma, double spatialSampling = 1, double rangeSampling = 1);
       // non-local means filter
-      Mat nlmFilter(Mat& src, int searchSize, double sigma);
+      Mat nlmFilter(Mat& src, int searchSize, double sigma, bool preselect = false, NlmStatistics* statistics = 0);
+      // straightforward non-local means filter, reference for the faster one
+      Mat nlmFilterNaive(Mat& src, int searchSize, double sigma);
+
+      // straightforward convolution, reference for the faster one
+      Mat spatialConvolutionNaive(Mat&, Mat&);
 
       // function headers of given functions
       // performs noise reduction
@@ -48,6 +82,15 @@ class Dip2{
 
       // test functions
       void test_spatialConvolution(void);
+      void test_convolutionEngines(void);
+      void test_separableConvolution(void);
       void test_averageFilter(void);
       void test_medianFilter(void);
+      void test_medianEngines(void);
+      void test_bilateralFilter(void);
+      void test_bilateralGrid(void);
+      void test_nlmFilter(void);
+      void test_streamFilter(void);
+      void test_fixedPoint(void);
+      void test_addNoise(void);
 };
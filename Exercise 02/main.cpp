@@ -14,12 +14,15 @@ using namespace std;
 
 // usage: argv[1] == "generate" to generate noisy images, path to original image in argv[2]
 // 	    argv[1] == "restorate" to load and restorate noisy images
+// 	    argv[1] == "benchmark" to measure processing times
+// 	    argv[1] == "stream" to filter a raw 8-bit image in strips: input, output, rows, cols, method, kSize and (optional) param in argv[2..8]
+// 	    argv[1] == "corpus" to write a reproducible noise corpus: original image, output directory, count and (optional) seed in argv[2..5]
 // main function. only calls processing and test routines
 int main(int argc, char** argv) {
 
    // check if enough arguments are defined
    if (argc < 2){
-      cout << "Usage:\n\tdip2 generate path_to_original\n\tdip2 restorate"  << endl;
+      cout << "Usage:\n\tdip2 generate path_to_original\n\tdip2 restorate\n\tdip2 benchmark\n\tdip2 stream input.raw output.raw rows cols method kSize [param]\n\tdip2 corpus path_to_original outdir count [seed]"  << endl;
       cout << "Press enter to exit"  << endl;
       cin.get();
       return -1;
@@ -50,5 +53,32 @@ int main(int argc, char** argv) {
       dip2.run();
    }
 
+   // measure processing times
+   if (strcmp(argv[1], "benchmark") == 0){
+      dip2.benchmark();
+   }
+
+   // filter an image that does not fit into memory
+   if (strcmp(argv[1], "stream") == 0){
+      if (argc < 8){
+         cout << "ERROR: stream needs input, output, rows, cols, method and kSize"  << endl;
+         return -2;
+      }
+      double param = argc > 8 ? atof(argv[8]) : 0;
+      if (!dip2.streamFilter(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]), argv[6], atoi(argv[7]), param))
+         return -3;
+   }
+
+   // generate a noise corpus for tests and benchmarks
+   if (strcmp(argv[1], "corpus") == 0){
+      if (argc < 5){
+         cout << "ERROR: corpus needs original image, output directory and count"  << endl;
+         return -2;
+      }
+      uint64 seed = argc > 5 ? strtoull(argv[5], 0, 10) : 0;
+      if (!dip2.generateNoiseCorpus(argv[2], argv[3], atoi(argv[4]), seed))
+         return -3;
+   }
+
 	return 0;
 } 
@@ -7,6 +7,12 @@
 //============================================================================
 
 #include "Dip3.h"
+#include "convolution.h"
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <map>
+#include <mutex>
 
 // Generates gaussian filter kernel of given size
 /*
@@ -43,6 +49,39 @@ Mat Dip3::createGaussianKernel(int kSize)
 	return GaussianKernel;
 }
 
+// swaps two images of equal size and type row by row
+static void swapBlocks(Mat a, Mat b)
+{
+	size_t bytes = a.cols * a.elemSize();
+	for (int i = 0; i < a.rows; i++)
+		std::swap_ranges(a.ptr(i), a.ptr(i) + bytes, b.ptr(i));
+}
+
+// rotates the rows of an image y rows downwards by following the cycles of the permutation
+// every row is swapped into place once, no row buffer is needed
+static void rotateRows(Mat &img, int y)
+{
+	size_t bytes = img.cols * img.elemSize();
+	// the permutation consists of gcd(rows, y) cycles
+	int cycles = img.rows, rest = y;
+	while (rest != 0)
+	{
+		int tmp = cycles % rest;
+		cycles = rest;
+		rest = tmp;
+	}
+	for (int start = 0; start < cycles; start++)
+	{
+		int current = start, next = (start - y + img.rows) % img.rows;
+		while (next != start)
+		{
+			std::swap_ranges(img.ptr(current), img.ptr(current) + bytes, img.ptr(next));
+			current = next;
+			next = (current - y + img.rows) % img.rows;
+		}
+	}
+}
+
 // Performes a circular shift in (dx,dy) direction
 /*
 in       input matrix
@@ -52,114 +91,191 @@ return   circular shifted matrix
 */
 Mat Dip3::circShift(const Mat &in, int dx, int dy)
 {
-	/*Cut source image into 4 parts (if dx > 0 & dy > 0)
-	0,0-----------------------------cols-1,0
-	-			      -			     	-
-	-		 0	      -		   1     	-
-    -				  -			     	-
-	-				  -			     	-
-	----------cols-dx,rows-dy(in 3)-----cols-1,rows-dy
-	-				  -			     	-
-	-		 2		  -		   3     	-
-	-				  -			     	-
-	-				  -			     	-	
-	----------cols-dx,rows-1------cols-1,rows-1
-
-	Cut result image into 4 parts
-	0,0------------dx-1,0----------cols-1,0
-	-			      -			     	-
-	-		 3		  -		   2     	-
-    -				  -			     	-
-	-				  -			     	-
-	0,dy-1----dx-1,dy-1(in 3)------------
-	-				  -			     	-
-	-		 1		  -		   0     	-
-	-				  -			     	-
-	-				  -			     	-	
-	-------------------------------------*/
-	Mat dst(in.size(), CV_32FC1);
-	int x, y;
-	// Adjust parameters
-	if (dx == 0 && dy == 0)
-		return in;
-	if (dx >= 0)
-		x = dx % in.cols;
-	else
-		x = dx % in.cols + in.cols;
-	if (dy >= 0)
-		y = dy % in.rows;
-	else
-		y = dy % in.rows + in.rows;
-
-	Mat tmp0, tmp1, tmp2, tmp3;
-	Mat part0(in, Rect(0, 0, in.cols - x, in.rows - y));
-	Mat part1(in, Rect(in.cols - x, 0, x, in.rows - y));
-	Mat part2(in, Rect(0, in.rows - y, in.cols - x, y));
-	Mat part3(in, Rect(in.cols - x, in.rows - y, x, y));
-	part0.copyTo(tmp0);
-	part1.copyTo(tmp1);
-	part2.copyTo(tmp2);
-	part3.copyTo(tmp3);
-	tmp0.copyTo(in(Rect(x, y, in.cols - x, in.rows - y)));
-	tmp1.copyTo(in(Rect(0, y, x, in.rows - y)));
-	tmp2.copyTo(in(Rect(x, 0, in.cols - x, y)));
-	tmp3.copyTo(in(Rect(0, 0, x, y)));
-
-	return in;
+	Mat dst(in.size(), in.type());
+	circShift(in, dst, dx, dy);
+	return dst;
+}
+
+// Performes a circular shift in (dx,dy) direction into a destination buffer
+// dst may be larger than in, i.e. zero padding (by the caller) and shift are done in one step
+// the parts of dst not covered by in are left untouched
+/*
+in       input matrix
+dst      output matrix, at least the size of in and of the same type, must not overlap in
+dx       shift in x-direction, modulo the width of dst
+dy       shift in y-direction, modulo the height of dst
+*/
+void Dip3::circShift(const Mat &in, Mat &dst, int dx, int dy)
+{
+	CV_Assert(in.type() == dst.type() && in.rows <= dst.rows && in.cols <= dst.cols);
+	int x = (dx % dst.cols + dst.cols) % dst.cols;
+	int y = (dy % dst.rows + dst.rows) % dst.rows;
+
+	// in is cut into up to 4 parts: the part that stays in place and the parts wrapping around the right and bottom border
+	int cols = std::min(in.cols, dst.cols - x);
+	int rows = std::min(in.rows, dst.rows - y);
+	in(Rect(0, 0, cols, rows)).copyTo(dst(Rect(x, y, cols, rows)));
+	if (cols < in.cols)
+		in(Rect(cols, 0, in.cols - cols, rows)).copyTo(dst(Rect(0, y, in.cols - cols, rows)));
+	if (rows < in.rows)
+		in(Rect(0, rows, cols, in.rows - rows)).copyTo(dst(Rect(x, 0, cols, in.rows - rows)));
+	if (cols < in.cols && rows < in.rows)
+		in(Rect(cols, rows, in.cols - cols, in.rows - rows)).copyTo(dst(Rect(0, 0, in.cols - cols, in.rows - rows)));
+}
+
+// Performes a circular shift in (dx,dy) direction in place, without temporary images
+// the half-size shift of even sized images (fftshift) swaps the quadrants in one pass
+/*
+img      matrix to shift
+dx       shift in x-direction
+dy       shift in y-direction
+*/
+void Dip3::circShiftInPlace(Mat &img, int dx, int dy)
+{
+	int x = (dx % img.cols + img.cols) % img.cols;
+	int y = (dy % img.rows + img.rows) % img.rows;
+
+	if (img.cols % 2 == 0 && img.rows % 2 == 0 && x == img.cols / 2 && y == img.rows / 2)
+	{
+		swapBlocks(img(Rect(0, 0, x, y)), img(Rect(x, y, x, y)));
+		swapBlocks(img(Rect(x, 0, x, y)), img(Rect(0, y, x, y)));
+		return;
+	}
+
+	rotateRows(img, y);
+	if (x == 0)
+		return;
+	size_t bytes = img.cols * img.elemSize(), shift = (img.cols - x) * img.elemSize();
+	for (int i = 0; i < img.rows; i++)
+		std::rotate(img.ptr(i), img.ptr(i) + shift, img.ptr(i) + bytes);
+}
+
+// maximal number of kernel spectra kept in the cache
+static const size_t SPECTRUM_CACHE_SIZE = 8;
+
+// returns the packed spectrum (CCS) of a kernel, every kernel is transformed only once per size
+/*
+kernel   filter kernel
+padded   size of the padded image, i.e. of the spectrum
+return   spectrum of the zero padded kernel, centred at the origin (CV_32FC1)
+*/
+Mat Dip3::kernelSpectrum(const Mat &kernel, Size padded)
+{
+	static std::map<string, Mat> cache;
+	static std::mutex cacheMutex;
+
+	// kernels are identified by contents, kernel size and padded size
+	Mat kernel32F;
+	kernel.convertTo(kernel32F, CV_32F);
+	string key((const char *)kernel32F.ptr(0), kernel32F.total() * kernel32F.elemSize());
+	key += to_string(kernel.rows) + "x" + to_string(kernel.cols) + "," + to_string(padded.height) + "x" + to_string(padded.width);
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	std::map<string, Mat>::iterator entry = cache.find(key);
+	if (entry != cache.end())
+		return entry->second;
+
+	// pad and centre the kernel in one step, the result is aligned with the image and needs no shift
+	Mat kernel_padded = Mat::zeros(padded, CV_32FC1);
+	circShift(kernel32F, kernel_padded, -(kernel.cols / 2), -(kernel.rows / 2));
+	Mat spectrum;
+	dft(kernel_padded, spectrum, 0);
+
+	if (cache.size() >= SPECTRUM_CACHE_SIZE)
+		cache.clear();
+	cache[key] = spectrum;
+	return spectrum;
 }
 
 //Performes convolution by multiplication in frequency domain
 /*
 in       input image
 kernel   filter kernel
-return   output image
+return   output image (CV_32FC1), borders are replicated as in the spatial domain
 */
 Mat Dip3::frequencyConvolution(const Mat &in, const Mat &kernel)
 {
-	// Expand the image to an optimal size to achieve maximal DFT performance
+	// the border of half the kernel size is replicated, so the circular convolution does not wrap around
+	// into the image, then the image is expanded to an optimal size to achieve maximal DFT performance
 	Mat in_padded;
-	int m = getOptimalDFTSize(in.rows);
-	int n = getOptimalDFTSize(in.cols);
-	copyMakeBorder(in, in_padded, 0, m - in.rows, 0, n - in.cols, BORDER_CONSTANT, Scalar::all(0));
-
-	// Generate padded kernel with the same size of padded origin image
-	Mat kernel_padded(in_padded.size(), CV_32FC1);
-	int r_top, r_bottom, r_left, r_right;
-	r_bottom = (in.rows - kernel.rows) / 2;
-	r_top = in.rows - kernel.rows - r_bottom;
-	r_right = (in.cols - kernel.cols) / 2;
-	r_left = in.cols - kernel.cols - r_right;
-	r_bottom += m - in.rows; // Corresponding to the optimal size of image
-	r_right += n - in.cols;
-	copyMakeBorder(kernel, kernel_padded, r_top, r_bottom, r_left, r_right, BORDER_CONSTANT, Scalar::all(0));
-
-	// Centre the kernel
-	kernel_padded = circShift(kernel_padded, in.cols - in.cols / 2, in.rows - in.rows / 2);
-	Mat kernel_planes[] = {Mat_<float>(kernel_padded), Mat::zeros(kernel_padded.size(), CV_32F)};
-	Mat kernel_complex;
-	merge(kernel_planes, 2, kernel_complex);
-
-	Mat in_planes[] = {Mat_<float>(in_padded), Mat::zeros(in_padded.size(), CV_32F)};
-	Mat in_complex;
-	merge(in_planes, 2, in_complex);
-	in_complex /= m * n;
-
-	dft(in_complex, in_complex, DFT_COMPLEX_OUTPUT);
-	dft(kernel_complex, kernel_complex, DFT_COMPLEX_OUTPUT);
+	int top = kernel.rows / 2, left = kernel.cols / 2;
+	int rows = in.rows + 2 * top;
+	int m = getOptimalDFTSize(rows);
+	int n = getOptimalDFTSize(in.cols + 2 * left);
+	copyMakeBorder(in, in_padded, top, top, left, left, BORDER_REPLICATE);
+	copyMakeBorder(in_padded, in_padded, 0, m - rows, 0, n - in_padded.cols, BORDER_CONSTANT, Scalar::all(0));
+	if (in_padded.depth() != CV_32F)
+		in_padded.convertTo(in_padded, CV_32F);
+
+	// real input: the packed spectrum (CCS) holds only the non-redundant half
+	// rows below the padded image are zero and skipped by the forward transform
+	Mat spectrum;
+	dft(in_padded, spectrum, 0, rows);
+	mulSpectrums(spectrum, kernelSpectrum(kernel, in_padded.size()), spectrum, 0);
+
+	// only the rows down to the end of the image are needed from the inverse transform
 	Mat dst;
+	dft(spectrum, dst, DFT_INVERSE | DFT_SCALE | DFT_REAL_OUTPUT, top + in.rows);
+
+	return dst(Rect(left, top, in.cols, in.rows));
+}
+
+// smallest block of the overlap-save convolution
+static const int FFT_BLOCK_MIN_SIZE = 64;
+// block size relative to the kernel size, i.e. about 3/4 of every block are valid output
+static const int FFT_BLOCK_KERNEL_FACTOR = 4;
+
+// performs convolution by multiplication in frequency domain, block by block (overlap-save)
+/*
+in       input image (CV_8UC1, CV_16UC1 or CV_32FC1)
+kernel   filter kernel
+return   output image (CV_32FC1), borders are replicated as in the spatial domain
+*/
+Mat Dip3::blockConvolution(const Mat &in, const Mat &kernel)
+{
+	// every block of size x size yields (size - kernel + 1)^2 valid output pixels
+	int size = getOptimalDFTSize(std::max(FFT_BLOCK_MIN_SIZE, FFT_BLOCK_KERNEL_FACTOR * std::max(kernel.rows, kernel.cols)));
+	int validRows = size - kernel.rows + 1;
+	int validCols = size - kernel.cols + 1;
+	int blockRows = (in.rows + validRows - 1) / validRows;
+	int blockCols = (in.cols + validCols - 1) / validCols;
 
-	mulSpectrums(in_complex, kernel_complex, dst, 0);
-	dft(dst, dst, DFT_INVERSE | DFT_REAL_OUTPUT);
-	dst = circShift(dst, n - in.cols, 0); // Adjust dst image and crop it later to origin size
+	// the last blocks read beyond the image, pad so that every block lies inside
+	Mat in_padded;
+	int top = kernel.rows / 2, left = kernel.cols / 2;
+	copyMakeBorder(in, in_padded, top, blockRows * validRows + kernel.rows - 1 - in.rows - top,
+				   left, blockCols * validCols + kernel.cols - 1 - in.cols - left, BORDER_REPLICATE);
+
+	// circular convolution with the kernel in the top left corner, the first kernel - 1 rows and columns wrap around
+	Mat kernel_padded, kernel_spectrum;
+	Mat kernel32F;
+	kernel.convertTo(kernel32F, CV_32F);
+	copyMakeBorder(kernel32F, kernel_padded, 0, size - kernel.rows, 0, size - kernel.cols, BORDER_CONSTANT, Scalar::all(0));
+	dft(kernel_padded, kernel_spectrum, 0);
 
-	return dst(Rect(0, 0, in.cols, in.rows));
+	Mat dst(in.size(), CV_32FC1);
+	parallel_for_(Range(0, blockRows * blockCols), [&](const Range &range) {
+		Mat block, spectrum;
+		for (int b = range.start; b < range.end; b++)
+		{
+			int y = b / blockCols * validRows, x = b % blockCols * validCols;
+			in_padded(Rect(x, y, size, size)).convertTo(block, CV_32F);
+			dft(block, spectrum, 0);
+			mulSpectrums(spectrum, kernel_spectrum, spectrum, 0);
+			dft(spectrum, block, DFT_INVERSE | DFT_SCALE | DFT_REAL_OUTPUT);
+			int rows = std::min(validRows, in.rows - y), cols = std::min(validCols, in.cols - x);
+			block(Rect(kernel.cols - 1, kernel.rows - 1, cols, rows)).copyTo(dst(Rect(x, y, cols, rows)));
+		}
+	});
+	return dst;
 }
 
 // Performs UnSharp Masking to enhance fine image structures
 /*
-in       the input image
+in       the input image (CV_8UC1, CV_16UC1 or CV_32FC1)
 type     integer defining how convolution for smoothing operation is done
          0 <==> spatial domain; 1 <==> frequency domain; 2 <==> seperable filter; 3 <==> integral image
+         4 <==> block-wise frequency domain; 5 <==> fastest method, see mySmooth()
 size     size of used smoothing kernel
 thresh   minimal intensity difference to perform operation
 scale    scaling of edge enhancement
@@ -175,22 +291,30 @@ Mat Dip3::usm(const Mat &in, int type, int size, double thresh, double scale)
 
 	// 1: smooth original image
 	//    save result in tmp for subsequent usage
+	//    in float for all depths, so the edges keep their fraction of a grey value
 	switch (type)
 	{
 	case 0:
-		tmp = mySmooth(in, size, 0);
+		tmp = mySmooth(in, size, 0, CV_32F);
 		break;
 	case 1:
-		tmp = mySmooth(in, size, 1);
+		tmp = mySmooth(in, size, 1, CV_32F);
 		break;
 	case 2:
-		tmp = mySmooth(in, size, 2);
+		tmp = mySmooth(in, size, 2, CV_32F);
 		break;
 	case 3:
-		tmp = mySmooth(in, size, 3);
+		tmp = mySmooth(in, size, 3, CV_32F);
+		break;
+	case 4:
+		tmp = mySmooth(in, size, 4, CV_32F);
+		break;
+	case 5:
+		tmp = mySmooth(in, size, 5, CV_32F);
 		break;
 	default:
-		GaussianBlur(in, tmp, Size(floor(size / 2) * 2 + 1, floor(size / 2) * 2 + 1), size / 5., size / 5.);
+		in.convertTo(tmp, CV_32F);
+		GaussianBlur(tmp, tmp, Size(floor(size / 2) * 2 + 1, floor(size / 2) * 2 + 1), size / 5., size / 5.);
 	}
 	// For test use only
 	/*if (sum(tmp > 255).val[0] > 0)
@@ -214,71 +338,107 @@ Mat Dip3::usm(const Mat &in, int type, int size, double thresh, double scale)
 		break;
 	}*/
 
-	Mat edge = in - tmp;
+	// the signed edges are kept in float, only the result has (and saturates to) the depth of the input
+	Mat edge;
+	subtract(in, tmp, edge, noArray(), CV_32F);
 	threshold(edge, edge, thresh, 0, THRESH_TOZERO);
 	edge *= scale;
-	Mat dst = in + edge;
+	Mat dst;
+	add(in, edge, dst, noArray(), in.depth());
 
 	return dst;
 }
 
+// fixed-point convolution of an 8-bit or 16-bit image, rank 1 kernels (e.g. Gaussian) in two passes
+/*
+src       input image (CV_8UC1 or CV_16UC1)
+column    column kernel, kernel = column * row
+row       row kernel
+ddepth    depth of the output
+return    convolution result
+*/
+static Mat convolveFixedSeparable(const Mat &src, const Mat &column, const Mat &row, int ddepth)
+{
+	Mat dst(src.size(), CV_MAKETYPE(ddepth, 1));
+	Mat src_padded, column_flipped, row_flipped;
+	copyMakeBorder(src, src_padded, column.rows / 2, column.rows / 2, row.cols / 2, row.cols / 2, BORDER_REPLICATE);
+	flip(column, column_flipped, -1);
+	flip(row, row_flipped, -1);
+	if (src.depth() == CV_8U)
+		convolveFixedSeparable<uchar>(src_padded, column_flipped, row_flipped, 255, dst);
+	else
+		convolveFixedSeparable<ushort>(src_padded, column_flipped, row_flipped, 65535, dst);
+	return dst;
+}
+
 // convolution in spatial domain
+// 8-bit and 16-bit images are convolved in fixed point, see common/convolution.cpp
 /*
-src:    input image
+src:    input image (CV_8UC1, CV_16UC1 or CV_32FC1)
 kernel:  filter kernel
+ddepth:  depth of the output (CV_8U, CV_16U, CV_16S or CV_32F), -1: depth of src
 return:  convolution result
 */
-Mat Dip3::spatialConvolution(const Mat &src, const Mat &kernel)
+Mat Dip3::spatialConvolution(const Mat &src, const Mat &kernel, int ddepth)
 {
-	Mat dst(src.size(), CV_32FC1);
-	Mat kernel_flipped(kernel.size(), CV_32FC1);
-	Mat src_padded(src.rows + kernel.rows - 1, src.cols + kernel.cols - 1, CV_32FC1);
+	if (ddepth < 0)
+		ddepth = src.depth();
+	Mat kernel_flipped;
+	Mat src_padded;
 	copyMakeBorder(src, src_padded, kernel.rows / 2, kernel.rows / 2, kernel.cols / 2, kernel.cols / 2, BORDER_REPLICATE);
-
-	int i, j, m, n;
-	float temp;
 	// Generate a flipped kernel first
-	for (i = 0; i < kernel.rows; i++)
+	flip(kernel, kernel_flipped, -1);
+
+	if (src.depth() == CV_8U || src.depth() == CV_16U)
 	{
-		float *kernel_data = kernel_flipped.ptr<float>(i);
-		const float *kernel_origin = kernel.ptr<float>(kernel.rows - i - 1);
-		kernel_origin += kernel.cols - 1;
-		for (j = 0; j < kernel.cols; j++)
+		SeparableKernel separable = kernel.rows > 1 && kernel.cols > 1 ? separableKernel(kernel_flipped) : SeparableKernel();
+		if (separable.separable && separable.columns.size() == 1)
 		{
-			*kernel_data++ = *kernel_origin--; //Coordinates flipped
+			// the decomposition is of the flipped kernel, flip it back
+			Mat column, row;
+			flip(separable.columns[0], column, -1);
+			flip(separable.rows[0], row, -1);
+			return convolveFixedSeparable(src, column, row, ddepth);
 		}
+		Mat dst(src.size(), CV_MAKETYPE(ddepth, 1));
+		FixedKernel fixed = fixedKernel(kernel_flipped, src.depth() == CV_8U ? 255 : 65535);
+		if (src.depth() == CV_8U)
+			convolveFixedDepth<uchar>(src_padded, fixed, dst, fixed.shift);
+		else
+			convolveFixedDepth<ushort>(src_padded, fixed, dst, fixed.shift);
+		return dst;
 	}
 
-	for (i = 0; i < dst.rows; i++)
+	Mat dst(src.size(), CV_32FC1);
+
+	// Low-rank kernels (e.g. Gaussian: rank 1) are applied as sum of column and row passes
+	if (kernel.rows > 1 && kernel.cols > 1)
 	{
-		float *dst_data = dst.ptr<float>(i);
-		for (j = 0; j < dst.cols; j++)
+		SeparableKernel separable = separableKernel(kernel_flipped);
+		if (separable.separable)
 		{
-			temp = 0;
-			for (m = 0; m < kernel.rows; m++)
-			{
-				const float *src_data = src_padded.ptr<float>(i + m);
-				src_data += j;
-				const float *kernel_data = kernel_flipped.ptr<float>(m);
-				for (n = 0; n < kernel.cols; n++)
-				{
-					temp += (*src_data++) * (*kernel_data++);
-				}
-			}
-			*dst_data++ = temp;
+			convolveSeparable(src_padded, separable, dst, convolutionEngine());
+			if (ddepth != CV_32F)
+				dst.convertTo(dst, ddepth);
+			return dst;
 		}
 	}
 
+	convolve2D(src_padded, kernel_flipped, dst, convolutionEngine());
+	if (ddepth != CV_32F)
+		dst.convertTo(dst, ddepth);
+
 	return dst;
 }
 
 // convolution in spatial domain by seperable filters
 /*
-src:    input image
+src:    input image (CV_8UC1, CV_16UC1 or CV_32FC1)
 size     size of filter kernel
+ddepth:  depth of the output, -1: depth of src
 return:  convolution result
 */
-Mat Dip3::seperableFilter(const Mat &src, int size)
+Mat Dip3::seperableFilter(const Mat &src, int size, int ddepth)
 {
 	int r = size / 2;
 	Mat filter(1, size, CV_32FC1); // one-dimensional Gaussian Filter
@@ -299,22 +459,51 @@ Mat Dip3::seperableFilter(const Mat &src, int size)
 	sum = sum * 2 + 1;
 	filter /= sum;
 
-	return spatialConvolution(spatialConvolution(src, filter.t()), filter);
+	// 8-bit and 16-bit images keep the fraction bits of the vertical pass
+	if (src.depth() == CV_8U || src.depth() == CV_16U)
+		return convolveFixedSeparable(src, filter.t(), filter, ddepth < 0 ? src.depth() : ddepth);
+	return spatialConvolution(spatialConvolution(src, filter.t()), filter, ddepth);
 }
 
 // convolution in spatial domain by integral images
+// the integral image of 8-bit and 16-bit images is exact (32 bit integers for 8-bit images as long as they
+// cannot overflow, double otherwise), integer averages are rounded to nearest
 /*
-src:    input image
+src:    input image (CV_8UC1, CV_16UC1 or CV_32FC1)
 size     size of filter kernel
+ddepth:  depth of the output, -1: depth of src
 return:  convolution result
 */
-Mat Dip3::satFilter(const Mat &src, int size)
+Mat Dip3::satFilter(const Mat &src, int size, int ddepth)
 {
 	int r = size / 2;
 	int size_square = size * size;
-	Mat dst(src.size(), CV_32FC1);
-	Mat src_padded(src.rows + 2 * r, src.cols + 2 * r, CV_32FC1);
+	if (ddepth < 0)
+		ddepth = src.depth();
+	Mat src_padded(src.rows + 2 * r, src.cols + 2 * r, src.type());
 	copyMakeBorder(src, src_padded, r, r, r, r, BORDER_REPLICATE); // One more row in the top and one more column in the left for integral image padded
+
+	if (src.depth() == CV_8U || src.depth() == CV_16U)
+	{
+		Mat Integral;
+		integral(src_padded, Integral, src.depth() == CV_8U && 255. * src_padded.total() <= INT_MAX ? CV_32S : CV_64F);
+		Mat sums(src.size(), CV_64FC1), dst;
+		for (int i = 0; i < sums.rows; i++)
+		{
+			double *sum_data = sums.ptr<double>(i);
+			for (int j = 0; j < sums.cols; j++)
+			{
+				if (Integral.depth() == CV_32S)
+					sum_data[j] = Integral.at<int>(i + size, j + size) - Integral.at<int>(i + size, j) - Integral.at<int>(i, j + size) + Integral.at<int>(i, j);
+				else
+					sum_data[j] = Integral.at<double>(i + size, j + size) - Integral.at<double>(i + size, j) - Integral.at<double>(i, j + size) + Integral.at<double>(i, j);
+			}
+		}
+		sums.convertTo(dst, ddepth, 1. / size_square);
+		return dst;
+	}
+
+	Mat dst(src.size(), CV_32FC1);
 	Mat Integral(src.rows + 1, src.cols + 1, CV_32FC1);
 	integral(src_padded, Integral, CV_32FC1);
 
@@ -327,6 +516,8 @@ Mat Dip3::satFilter(const Mat &src, int size)
 			*dst_data++ = (Integral.at<float>(i + size, j + size) - Integral.at<float>(i + size, j) - Integral.at<float>(i, j + size) + Integral.at<float>(i, j)) / size_square;
 		}
 	}
+	if (ddepth != CV_32F)
+		dst.convertTo(dst, ddepth);
 
 	return dst;
 }
@@ -355,32 +546,226 @@ Mat Dip3::run(const Mat &in, int smoothType, int size, double thresh, double sca
 	return usm(in, smoothType, size, thresh, scale);
 }
 
+// operations per sample and log2 of the transform size for forward and inverse real DFT and the product
+static const double COST_FFT = 2.5;
+// working set (bytes) of a full-size transform that still fits into the cache
+static const double COST_FFT_CACHE_BYTES = 8 << 20;
+// slow down of a full-size transform beyond that working set
+static const double COST_FFT_CACHE_PENALTY = 3;
+
+// estimates the operations per output pixel of a smoothing method
+/*
+size     image size
+kSize    size of the filter kernel
+type     0 <==> spatial domain; 1 <==> frequency domain; 2 <==> seperable filter; 4 <==> block-wise frequency domain
+return   estimated cost, comparable between methods
+*/
+static double smoothCost(Size size, int kSize, int type)
+{
+	switch (type)
+	{
+	case 0:
+		return kSize * kSize;
+	case 1:
+	{
+		// the image is padded by the kernel size
+		double points = (double)getOptimalDFTSize(size.height + kSize - 1) * getOptimalDFTSize(size.width + kSize - 1);
+		// padded image and its spectrum
+		double penalty = 2 * points * sizeof(float) > COST_FFT_CACHE_BYTES ? COST_FFT_CACHE_PENALTY : 1;
+		return COST_FFT * std::log2(points) * points / size.area() * penalty;
+	}
+	case 2:
+		return 2 * kSize;
+	default:
+	{
+		int block = getOptimalDFTSize(std::max(FFT_BLOCK_MIN_SIZE, FFT_BLOCK_KERNEL_FACTOR * kSize));
+		double points = (double)block * block;
+		return COST_FFT * std::log2(points) * points / ((block - kSize + 1) * (block - kSize + 1));
+	}
+	}
+}
+
+// chooses the cheapest exact smoothing method by the cost model above
+// the integral image is not considered, it approximates the gaussian by a box filter
+/*
+size     image size
+kSize    size of the filter kernel
+return   type of the smoothing method, see mySmooth()
+*/
+static int cheapestSmoothing(Size size, int kSize)
+{
+	int types[] = {0, 1, 2, 4};
+	int best = types[0];
+	for (int t = 1; t < 4; t++)
+		if (smoothCost(size, kSize, types[t]) < smoothCost(size, kSize, best))
+			best = types[t];
+	return best;
+}
+
+// file of the smoothing calibration, in the working directory
+static const char *CALIBRATION_PROFILE = "dip3_calibration.txt";
+// image sides and kernel sizes of the calibration
+static const int CALIBRATION_SIDES[] = {256, 1024};
+static const int CALIBRATION_KERNELS[] = {3, 9, 21, 41};
+// every configuration is repeated for at least this time (seconds)
+static const double CALIBRATION_MIN_TIME = 0.05;
+// methods the cost model predicts to be this much slower than the cheapest one are not measured
+static const double CALIBRATION_SKIP_FACTOR = 8;
+
+// measures the smoothing methods at the current number of threads
+/*
+depth    depth of the images (CV_8U, CV_16U or CV_32F)
+return   time of every measured method for every calibrated image and kernel size
+*/
+vector<SmoothTiming> Dip3::calibrateSmoothing(int depth)
+{
+	vector<SmoothTiming> timings;
+	int types[] = {0, 1, 2, 4};
+	for (int side : CALIBRATION_SIDES)
+	{
+		Mat img(side, side, CV_MAKETYPE(depth, 1));
+		randu(img, 0, depth == CV_16U ? 65536 : 256);
+		for (int kSize : CALIBRATION_KERNELS)
+		{
+			double cheapest = smoothCost(img.size(), kSize, cheapestSmoothing(img.size(), kSize));
+			for (int type : types)
+			{
+				if (smoothCost(img.size(), kSize, type) > CALIBRATION_SKIP_FACTOR * cheapest)
+					continue;
+				// warm up, also fills the kernel caches as repeated calls would
+				mySmooth(img, kSize, type);
+				int runs = 0;
+				double elapsed;
+				int64 start = getTickCount();
+				do
+				{
+					mySmooth(img, kSize, type);
+					runs++;
+					elapsed = (getTickCount() - start) / getTickFrequency();
+				} while (elapsed < CALIBRATION_MIN_TIME);
+				SmoothTiming timing = {getNumThreads(), depth, side, kSize, type, elapsed / runs / (img.total() / 1e6)};
+				timings.push_back(timing);
+			}
+		}
+	}
+	return timings;
+}
+
+// looks up the fastest smoothing method for the nearest calibrated image and kernel size
+// image area and kernel size are compared on a log scale
+/*
+profile  measured processing times
+size     image size
+kSize    size of the filter kernel
+depth    depth of the image
+threads  number of threads
+return   type of the smoothing method, see mySmooth(); -1 if the profile has no entry for depth and threads
+*/
+static int fastestInProfile(const vector<SmoothTiming> &profile, Size size, int kSize, int depth, int threads)
+{
+	const SmoothTiming *nearest = 0;
+	double nearestDistance = 0;
+	for (size_t i = 0; i < profile.size(); i++)
+	{
+		if (profile[i].threads != threads || profile[i].depth != depth)
+			continue;
+		double distance = std::abs(std::log((double)profile[i].side * profile[i].side / size.area())) + std::abs(std::log((double)profile[i].kSize / kSize));
+		if (!nearest || distance < nearestDistance)
+		{
+			nearest = &profile[i];
+			nearestDistance = distance;
+		}
+	}
+	if (!nearest)
+		return -1;
+
+	const SmoothTiming *fastest = nearest;
+	for (size_t i = 0; i < profile.size(); i++)
+		if (profile[i].threads == threads && profile[i].depth == depth && profile[i].side == nearest->side && profile[i].kSize == nearest->kSize && profile[i].time < fastest->time)
+			fastest = &profile[i];
+	return fastest->type;
+}
+
+// chooses the fastest smoothing method for the nearest calibrated image and kernel size, see fastestInProfile()
+// the calibration runs once for every depth and number of threads, its results are kept in CALIBRATION_PROFILE
+/*
+size     image size
+kSize    size of the filter kernel
+depth    depth of the image
+return   type of the smoothing method, see mySmooth()
+*/
+int Dip3::fastestSmoothing(Size size, int kSize, int depth)
+{
+	static vector<SmoothTiming> profile;
+	static bool loaded = false;
+	static std::mutex profileMutex;
+
+	std::lock_guard<std::mutex> lock(profileMutex);
+	if (!loaded)
+	{
+		ifstream file(CALIBRATION_PROFILE);
+		SmoothTiming timing;
+		while (file >> timing.threads >> timing.depth >> timing.side >> timing.kSize >> timing.type >> timing.time)
+			profile.push_back(timing);
+		loaded = true;
+	}
+
+	int threads = getNumThreads();
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		int type = fastestInProfile(profile, size, kSize, depth, threads);
+		if (type >= 0)
+			return type;
+
+		// not calibrated yet
+		vector<SmoothTiming> timings = calibrateSmoothing(depth);
+		ofstream file(CALIBRATION_PROFILE, ios::app);
+		for (size_t i = 0; i < timings.size(); i++)
+		{
+			file << timings[i].threads << " " << timings[i].depth << " " << timings[i].side << " " << timings[i].kSize << " " << timings[i].type << " " << timings[i].time << endl;
+			profile.push_back(timings[i]);
+		}
+	}
+	return cheapestSmoothing(size, kSize);
+}
+
 // Performes smoothing operation by convolution
 /*
-in       input image
+in       input image (CV_8UC1, CV_16UC1 or CV_32FC1)
 size     size of filter kernel
 type     how is smoothing performed?
+         0 <==> spatial domain; 1 <==> frequency domain; 2 <==> seperable filter; 3 <==> integral image
+         4 <==> block-wise frequency domain; 5 <==> fastest of 0, 1, 2 and 4 on this machine, see fastestSmoothing()
+ddepth   depth of the output, -1: depth of in
 return   smoothed image
 */
-Mat Dip3::mySmooth(const Mat &in, int size, int type)
+Mat Dip3::mySmooth(const Mat &in, int size, int type, int ddepth)
 {
 
 	// create filter kernel
 	Mat kernel = createGaussianKernel(size);
+	if (ddepth < 0)
+		ddepth = in.depth();
+	if (type == 5)
+		type = fastestSmoothing(in.size(), size, in.depth());
 
 	// perform convoltion
 	switch (type)
 	{
 	case 0:
-		return spatialConvolution(in, kernel); // 2D spatial convolution
-	case 1:
-		return frequencyConvolution(in, kernel); // 2D convolution via multiplication in frequency domain
+		return spatialConvolution(in, kernel, ddepth); // 2D spatial convolution
 	case 2:
-		return seperableFilter(in, size); // seperable filter
+		return seperableFilter(in, size, ddepth); // seperable filter
 	case 3:
-		return satFilter(in, size); // integral image
+		return satFilter(in, size, ddepth); // integral image
 	default:
-		return frequencyConvolution(in, kernel);
+	{
+		// 2D convolution via multiplication in frequency domain, always in float
+		Mat dst = type == 4 ? blockConvolution(in, kernel) : frequencyConvolution(in, kernel);
+		if (ddepth != CV_32F)
+			dst.convertTo(dst, ddepth);
+		return dst;
+	}
 	}
 }
 
@@ -391,6 +776,11 @@ void Dip3::test(void)
 	test_createGaussianKernel();
 	test_circShift();
 	test_frequencyConvolution();
+	test_blockConvolution();
+	test_smoothingBorders();
+	test_fixedPoint();
+	test_usm();
+	test_fastestSmoothing();
 	cout << "Press enter to continue" << endl;
 	cin.get();
 }
@@ -432,6 +822,31 @@ void Dip3::test_circShift(void)
 		cout << "ERROR: Dip3::circShift(): Result of circshift seems to be wrong!" << endl;
 		return;
 	}
+
+	// in place and into a larger buffer, the second shift is the half-size (fftshift) case
+	Mat image(6, 8, CV_32FC1);
+	randu(image, 0, 1);
+	int shifts[4][2] = {{3, 2}, {4, 3}, {-5, 7}, {0, -4}};
+	for (int s = 0; s < 4; s++)
+	{
+		int dx = shifts[s][0], dy = shifts[s][1];
+		Mat shifted = image.clone();
+		Mat padded = Mat::zeros(9, 11, CV_32FC1);
+		circShiftInPlace(shifted, dx, dy);
+		circShift(image, padded, dx, dy);
+		for (int y = 0; y < image.rows; y++)
+		{
+			for (int x = 0; x < image.cols; x++)
+			{
+				if (shifted.at<float>(((y + dy) % 6 + 6) % 6, ((x + dx) % 8 + 8) % 8) != image.at<float>(y, x) or
+					padded.at<float>(((y + dy) % 9 + 9) % 9, ((x + dx) % 11 + 11) % 11) != image.at<float>(y, x))
+				{
+					cout << "ERROR: Dip3::circShift(): Result of in place or padded circshift seems to be wrong!" << endl;
+					return;
+				}
+			}
+		}
+	}
 	cout << "Message: Dip3::circShift() seems to be correct" << endl;
 }
 
@@ -449,18 +864,19 @@ void Dip3::test_frequencyConvolution(void)
 		cout << "ERROR: Dip3::frequencyConvolution(): Convolution result contains too large/small values!" << endl;
 		return;
 	}
-	float ref[9][9] = {{0, 0, 0, 0, 0, 0, 0, 0, 0},
-					   {0, 1, 1, 1, 1, 1, 1, 1, 0},
-					   {0, 1, 1, 1, 1, 1, 1, 1, 0},
-					   {0, 1, 1, (8 + 255) / 9., (8 + 255) / 9., (8 + 255) / 9., 1, 1, 0},
-					   {0, 1, 1, (8 + 255) / 9., (8 + 255) / 9., (8 + 255) / 9., 1, 1, 0},
-					   {0, 1, 1, (8 + 255) / 9., (8 + 255) / 9., (8 + 255) / 9., 1, 1, 0},
-					   {0, 1, 1, 1, 1, 1, 1, 1, 0},
-					   {0, 1, 1, 1, 1, 1, 1, 1, 0},
-					   {0, 0, 0, 0, 0, 0, 0, 0, 0}};
-	for (int y = 1; y < 8; y++)
-	{
-		for (int x = 1; x < 8; x++)
+	// borders are replicated
+	float ref[9][9] = {{1, 1, 1, 1, 1, 1, 1, 1, 1},
+					   {1, 1, 1, 1, 1, 1, 1, 1, 1},
+					   {1, 1, 1, 1, 1, 1, 1, 1, 1},
+					   {1, 1, 1, (8 + 255) / 9., (8 + 255) / 9., (8 + 255) / 9., 1, 1, 1},
+					   {1, 1, 1, (8 + 255) / 9., (8 + 255) / 9., (8 + 255) / 9., 1, 1, 1},
+					   {1, 1, 1, (8 + 255) / 9., (8 + 255) / 9., (8 + 255) / 9., 1, 1, 1},
+					   {1, 1, 1, 1, 1, 1, 1, 1, 1},
+					   {1, 1, 1, 1, 1, 1, 1, 1, 1},
+					   {1, 1, 1, 1, 1, 1, 1, 1, 1}};
+	for (int y = 0; y < 9; y++)
+	{
+		for (int x = 0; x < 9; x++)
 		{
 			if (abs(output.at<float>(y, x) - ref[y][x]) > 0.0001)
 			{
@@ -469,5 +885,153 @@ void Dip3::test_frequencyConvolution(void)
 			}
 		}
 	}
+	// the kernel spectrum is computed once and reused for the same kernel and size
+	Mat spectrum = kernelSpectrum(kernel, input.size());
+	if (spectrum.data != kernelSpectrum(kernel, input.size()).data or spectrum.type() != CV_32FC1)
+	{
+		cout << "ERROR: Dip3::frequencyConvolution(): Kernel spectrum is not cached!" << endl;
+		return;
+	}
+	if (norm(frequencyConvolution(input, kernel), output, NORM_INF) != 0)
+	{
+		cout << "ERROR: Dip3::frequencyConvolution(): Result changes with a cached kernel spectrum!" << endl;
+		return;
+	}
 	cout << "Message: Dip3::frequencyConvolution() seems to be correct" << endl;
 }
+
+void Dip3::test_blockConvolution(void)
+{
+
+	// several blocks in both directions, the last ones partially outside of the image
+	Mat input(157, 211, CV_32FC1);
+	randu(input, 0, 255);
+	Mat kernel = createGaussianKernel(21);
+
+	Mat output = blockConvolution(input, kernel);
+	Mat ref = spatialConvolution(input, kernel);
+	if (output.size() != input.size() || output.type() != CV_32FC1)
+	{
+		cout << "ERROR: Dip3::blockConvolution(): Result has wrong size or type!" << endl;
+		return;
+	}
+	if (norm(output, ref, NORM_INF) > 0.01)
+	{
+		cout << "ERROR: Dip3::blockConvolution(): Result differs from spatial convolution!" << endl;
+		return;
+	}
+	cout << "Message: Dip3::blockConvolution() seems to be correct" << endl;
+}
+
+// the exact smoothing methods that fastestSmoothing() chooses from must agree, also at the border
+void Dip3::test_smoothingBorders(void)
+{
+
+	Mat input(37, 45, CV_32FC1);
+	randu(input, 0, 255);
+	int kSizes[] = {3, 9, 21};
+	int types[] = {1, 2, 4};
+	for (int k = 0; k < 3; k++)
+	{
+		int r = kSizes[k] / 2;
+		Mat ref = spatialConvolution(input, createGaussianKernel(kSizes[k]));
+		Rect borders[] = {Rect(0, 0, input.cols, r), Rect(0, input.rows - r, input.cols, r),
+						  Rect(0, 0, r, input.rows), Rect(input.cols - r, 0, r, input.rows)};
+		for (int t = 0; t < 3; t++)
+		{
+			Mat output = mySmooth(input, kSizes[k], types[t]);
+			for (int b = 0; b < 4; b++)
+			{
+				if (norm(output(borders[b]), ref(borders[b]), NORM_INF) > 0.01)
+				{
+					cout << "ERROR: Dip3::mySmooth(): Border of type " << types[t] << " differs from spatial convolution for kSize " << kSizes[k] << endl;
+					return;
+				}
+			}
+		}
+	}
+	cout << "Message: Dip3::mySmooth() borders seem to be correct" << endl;
+}
+
+void Dip3::test_fixedPoint(void)
+{
+
+	int depths[] = {CV_8U, CV_16U};
+	double maxValues[] = {255, 65535};
+	for (int d = 0; d < 2; d++)
+	{
+		Mat input(31, 27, CV_MAKETYPE(depths[d], 1)), input32F;
+		randu(input, 0, maxValues[d] + 1);
+		input.convertTo(input32F, CV_32FC1);
+		for (int type = 0; type < 4; type++)
+		{
+			Mat output = mySmooth(input, 7, type), ref;
+			mySmooth(input32F, 7, type).convertTo(ref, depths[d]);
+			// rounding may differ by one, Q15 weights are precise to about half a step of a 16-bit value
+			if (output.depth() != depths[d] || norm(output, ref, NORM_INF) > (depths[d] == CV_8U ? 1 : 4))
+			{
+				cout << "ERROR: Dip3::mySmooth(): Result for depth " << depths[d] << " differs from float for type " << type << endl;
+				return;
+			}
+		}
+	}
+	cout << "Message: Dip3 fixed-point paths seem to be correct" << endl;
+}
+
+// unsharp masking of 8-bit images rounds only the result, the blur and the edges are float
+void Dip3::test_usm(void)
+{
+
+	Mat input(41, 37, CV_8UC1), input32F;
+	randu(input, 0, 256);
+	input.convertTo(input32F, CV_32FC1);
+	int types[] = {0, 1, 2, 3, 4};
+	for (int t = 0; t < 5; t++)
+	{
+		Mat output = usm(input, types[t], 7, 1, 5), ref;
+		usm(input32F, types[t], 7, 1, 5).convertTo(ref, CV_8U);
+		if (output.depth() != CV_8U || norm(output, ref, NORM_INF) > 1)
+		{
+			cout << "ERROR: Dip3::usm(): Result for 8-bit input differs from float for type " << types[t] << endl;
+			return;
+		}
+	}
+	cout << "Message: Dip3::usm() seems to be correct" << endl;
+}
+
+void Dip3::test_fastestSmoothing(void)
+{
+
+	// synthetic profile: {threads, depth, side, kSize, type, time}
+	// the separable filter wins for small kernels, the block FFT for large ones, the full FFT for large kernels on large images
+	SmoothTiming timings[] = {
+		{1, CV_8U, 256, 3, 0, 2}, {1, CV_8U, 256, 3, 2, 1}, {1, CV_8U, 256, 41, 2, 9}, {1, CV_8U, 256, 41, 4, 5},
+		{1, CV_8U, 1024, 3, 0, 40}, {1, CV_8U, 1024, 3, 2, 20}, {1, CV_8U, 1024, 41, 1, 60}, {1, CV_8U, 1024, 41, 4, 80},
+		// other configurations must not be taken into account
+		{2, CV_8U, 512, 9, 1, 0.1}, {1, CV_32F, 512, 9, 1, 0.1}};
+	vector<SmoothTiming> profile(timings, timings + sizeof(timings) / sizeof(timings[0]));
+
+	struct
+	{
+		Size size;
+		int kSize, depth, type;
+	} queries[] = {
+		{Size(256, 256), 3, CV_8U, 2},    // calibrated
+		{Size(300, 200), 5, CV_8U, 2},    // nearest: 256, 3
+		{Size(200, 300), 31, CV_8U, 4},   // nearest: 256, 41
+		{Size(2000, 1000), 21, CV_8U, 1}, // nearest: 1024, 41
+		{Size(4000, 4000), 3, CV_8U, 2},  // nearest: 1024, 3
+		{Size(512, 512), 9, CV_8U, 2},    // nearest: 256, 3 (512, 9 is for other configurations)
+		{Size(256, 256), 3, CV_16U, -1},  // not calibrated
+	};
+	for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++)
+	{
+		int type = fastestInProfile(profile, queries[q].size, queries[q].kSize, queries[q].depth, 1);
+		if (type != queries[q].type)
+		{
+			cout << "ERROR: Dip3::fastestSmoothing(): Chose method " << type << " instead of " << queries[q].type << " for " << queries[q].size.width << "x" << queries[q].size.height << " and kSize " << queries[q].kSize << endl;
+			return;
+		}
+	}
+	cout << "Message: Dip3::fastestSmoothing() seems to be correct" << endl;
+}
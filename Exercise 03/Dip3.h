@@ -13,6 +13,18 @@
 using namespace std;
 using namespace cv;
 
+// measured time of a smoothing method, one line of the calibration profile
+struct SmoothTiming{
+   // number of threads, depth of the image
+   int threads, depth;
+   // side of the square image, size of the kernel
+   int side, kSize;
+   // smoothing method, see Dip3::mySmooth()
+   int type;
+   // seconds per megapixel
+   double time;
+};
+
 class Dip3{
 
    public:
@@ -26,25 +38,38 @@ class Dip3{
       Mat run(const Mat& in, int smoothType, int size, double thresh, double scale);
       // run testing routine
       void test(void);
+      // Performes smoothing operation by convolution
+      Mat mySmooth(const Mat& in, int size, int type, int ddepth = -1);
 
    private:
       // function headers of functions to be implemented
       // --> please edit ONLY these functions!
       Mat createGaussianKernel(int kSize);
       Mat circShift(const Mat& in, int dx, int dy);
+      void circShift(const Mat& in, Mat& dst, int dx, int dy);
+      void circShiftInPlace(Mat& img, int dx, int dy);
       Mat frequencyConvolution(const Mat& in, const Mat& kernel);
-      Mat satFilter(const Mat& src, int size);
-      Mat seperableFilter(const Mat& src, int size);
+      Mat kernelSpectrum(const Mat& kernel, Size padded);
+      Mat blockConvolution(const Mat& in, const Mat& kernel);
+      Mat satFilter(const Mat& src, int size, int ddepth = -1);
+      Mat seperableFilter(const Mat& src, int size, int ddepth = -1);
       Mat usm(const Mat& in, int smoothType, int size, double thresh, double scale);
       // function headers of functions to implemented in previous exercises
       // --> re-use your (corrected) code
-      Mat spatialConvolution(const Mat&, const Mat&);
+      Mat spatialConvolution(const Mat&, const Mat&, int ddepth = -1);
     
       // function headers of given functions
-      // Performes smoothing operation by convolution
-      Mat mySmooth(const Mat& in, int size, int type);
+      // chooses the fastest smoothing method of this machine
+      int fastestSmoothing(Size size, int kSize, int depth);
+      // measures the smoothing methods for one depth
+      vector<SmoothTiming> calibrateSmoothing(int depth);
       
       void test_createGaussianKernel(void);
       void test_circShift(void);
       void test_frequencyConvolution(void);
+      void test_blockConvolution(void);
+      void test_smoothingBorders(void);
+      void test_fixedPoint(void);
+      void test_usm(void);
+      void test_fastestSmoothing(void);
 };
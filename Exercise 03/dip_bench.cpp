@@ -0,0 +1,49 @@
+//============================================================================
+// Name        : dip_bench.cpp
+// Author      : Ronny Haensch
+// Version     : 2.0
+// Copyright   : -
+// Description : benchmark of the smoothing methods of the third DIP assignment
+//============================================================================
+
+#include <benchmark/benchmark.h>
+
+#include "Dip3.h"
+
+// names of the smoothing methods, index is the type of Dip3::mySmooth()
+static const char *METHODS[] = {"spatial", "frequency", "separable", "integral", "block"};
+
+// smoothing of a random square image
+// arguments: side of the image, kernel size, type of Dip3::mySmooth(), depth of the image
+static void BM_mySmooth(benchmark::State &state)
+{
+	int side = state.range(0), kSize = state.range(1), type = state.range(2), depth = state.range(3);
+	Dip3 dip3;
+	Mat in(side, side, CV_MAKETYPE(depth, 1));
+	randu(in, 0, 256);
+
+	// warm up: allocates the output and fills the kernel caches as repeated calls in usm would
+	Mat out = dip3.mySmooth(in, kSize, type);
+	for (auto _ : state)
+	{
+		out = dip3.mySmooth(in, kSize, type);
+		benchmark::DoNotOptimize(out.data);
+	}
+
+	state.SetLabel(string(METHODS[type]) + (depth == CV_8U ? " 8U" : " 32F"));
+	state.counters["MPixel/s"] = benchmark::Counter(in.total() / 1e6, benchmark::Counter::kIsIterationInvariantRate);
+	// bytes read and written per pixel
+	state.counters["bytes/pixel"] = in.elemSize() + out.elemSize();
+	state.counters["threads"] = getNumThreads();
+	state.SetBytesProcessed(state.iterations() * in.total() * (in.elemSize() + out.elemSize()));
+}
+// wall time, the methods may run in parallel
+BENCHMARK(BM_mySmooth)
+	->ArgNames({"side", "kSize", "type", "depth"})
+	->ArgsProduct({{256, 1024, 2048}, {3, 9, 21, 41}, {0, 1, 2, 3, 4}, {CV_8U, CV_32F}})
+	->Repetitions(5)
+	->ReportAggregatesOnly(true)
+	->UseRealTime()
+	->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -9,7 +9,6 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
-#include <time.h>
 
 #include "Dip3.h"
 
@@ -40,6 +39,7 @@ int main(int argc, char** argv) {
    fstream fileFrequency("convolutionFrequencyDomain.txt", ios::out);
    fstream fileSeperable("convolutionSeperableFilter.txt", ios::out);
    fstream fileIntegral("convolutionIntegralImages.txt", ios::out);
+   fstream fileAuto("convolutionAuto.txt", ios::out);
   
    // some windows for displaying images
    const char* win_1 = "Degraded Image";
@@ -49,8 +49,10 @@ int main(int argc, char** argv) {
    namedWindow( win_2, CV_WINDOW_AUTOSIZE );
    namedWindow( win_3, CV_WINDOW_AUTOSIZE );
     
-   // for time measurements
-   clock_t time;
+   // for time measurements, wall time (clock() sums the cpu time of all threads)
+   // see dip_bench for repeated measurements
+   int64 time;
+   double seconds;
    
    // parameter of USM
    int numberOfKernelSizes = 10;        // number of differently sized smoothing kernels
@@ -76,13 +78,12 @@ int main(int argc, char** argv) {
    imshow( win_1, imgIn);
 
    // create output image
-   Mat result = Mat(imgIn.rows, imgIn.cols, CV_32FC3);
+   Mat result = Mat(imgIn.rows, imgIn.cols, CV_8UC3);
    
    // convert and split input image
    // convert BGR to HSV
    cvtColor(imgIn, imgIn, CV_BGR2HSV);
-   // convert U8 to 32F
-   imgIn.convertTo(imgIn, CV_32FC3);
+   // the value-channel stays 8-bit, smoothing runs in fixed point
    // split into planes
    vector<Mat> planes;
    split(imgIn, planes);
@@ -97,7 +98,9 @@ int main(int argc, char** argv) {
       int size = 4*s+1;
 
       // either working in spatial or frequency domain
-      for(int type=0; type<4; type++){ // use this line, if you implemented the optional parts
+      // type 5 picks the fastest method, the first call calibrates this machine (see Dip3::fastestSmoothing)
+      int types[] = {0, 1, 2, 3, 5};
+      for(int type : types){ // use this line, if you implemented the optional parts
       //for(int type=0; type<2; type++){
          // speak to me
          switch(type){
@@ -105,31 +108,36 @@ int main(int argc, char** argv) {
             case 1: cout << "> USM (" << size << "x" << size << ", using frequency domain):\t" << endl;break;
 	    case 2: cout << "> USM (" << size << "x" << size << ", using seperable filters):\t" << endl;break;
 	    case 3: cout << "> USM (" << size << "x" << size << ", using integral images):\t" << endl;break;
+	    case 5: cout << "> USM (" << size << "x" << size << ", using fastest method):\t" << endl;break;
          }
          
          // measure starting time
-         time = clock();
+         time = getTickCount();
          // perform unsharp masking
          Mat tmp = dip3.run(value, type, size, thresh, scale);
          // measure stopping time
-         time = (clock() - time);
+         seconds = (getTickCount() - time) / getTickFrequency();
          // print the ellapsed time
          switch(type){
             case 0:
-               cout << ((double)time)/CLOCKS_PER_SEC << "sec\n" << endl;
-               fileSpatial << ((double)time)/CLOCKS_PER_SEC << endl;
+               cout << seconds << "sec\n" << endl;
+               fileSpatial << seconds << endl;
                break;
             case 1:
-               cout << ((double)time)/CLOCKS_PER_SEC << "sec\n" << endl;
-               fileFrequency << ((double)time)/CLOCKS_PER_SEC << endl;
+               cout << seconds << "sec\n" << endl;
+               fileFrequency << seconds << endl;
                break;
 	    case 2:
-               cout << ((double)time)/CLOCKS_PER_SEC << "sec\n" << endl;
-               fileSeperable << ((double)time)/CLOCKS_PER_SEC << endl;
+               cout << seconds << "sec\n" << endl;
+               fileSeperable << seconds << endl;
                break;
 	    case 3:
-               cout << ((double)time)/CLOCKS_PER_SEC << "sec\n" << endl;
-               fileIntegral << ((double)time)/CLOCKS_PER_SEC << endl;
+               cout << seconds << "sec\n" << endl;
+               fileIntegral << seconds << endl;
+               break;
+	    case 5:
+               cout << seconds << "sec\n" << endl;
+               fileAuto << seconds << endl;
                break;
          }
       
@@ -137,8 +145,6 @@ int main(int argc, char** argv) {
          planes.at(2) = tmp;
          // merge planes to color image
          merge(planes, result);
-         // convert 32F to U8
-         result.convertTo(result, CV_8UC3);
          // convert HSV to BGR
          cvtColor(result, result, CV_HSV2BGR);
       
@@ -151,17 +157,16 @@ int main(int argc, char** argv) {
             case 1: fname << "frequencyDomain";break;
 	    case 2: fname << "sperableFilters";break;
 	    case 3: fname << "integralImage";break;
+	    case 5: fname << "auto";break;
          }
          imshow( win_2, result);
          imwrite((fname.str() + "_enhanced.png").c_str(), result);
          
          // produce difference image
-         planes.at(2) = abs(tmp - value);
+         absdiff(tmp, value, planes.at(2));
          normalize(planes.at(2), planes.at(2), 0, 255, CV_MINMAX);
          // merge planes to color image
          merge(planes, result);
-         // convert 32F to U8
-         result.convertTo(result, CV_8UC3);
          // convert HSV to BGR
          cvtColor(result, result, CV_HSV2BGR);
          imshow( win_3, result);
@@ -7,6 +7,40 @@
 //============================================================================
 
 #include "Dip4.h"
+#include <algorithm>
+
+// swaps two images of equal size and type row by row
+static void swapBlocks(Mat a, Mat b)
+{
+	size_t bytes = a.cols * a.elemSize();
+	for (int i = 0; i < a.rows; i++)
+		std::swap_ranges(a.ptr(i), a.ptr(i) + bytes, b.ptr(i));
+}
+
+// rotates the rows of an image y rows downwards by following the cycles of the permutation
+// every row is swapped into place once, no row buffer is needed
+static void rotateRows(Mat &img, int y)
+{
+	size_t bytes = img.cols * img.elemSize();
+	// the permutation consists of gcd(rows, y) cycles
+	int cycles = img.rows, rest = y;
+	while (rest != 0)
+	{
+		int tmp = cycles % rest;
+		cycles = rest;
+		rest = tmp;
+	}
+	for (int start = 0; start < cycles; start++)
+	{
+		int current = start, next = (start - y + img.rows) % img.rows;
+		while (next != start)
+		{
+			std::swap_ranges(img.ptr(current), img.ptr(current) + bytes, img.ptr(next));
+			current = next;
+			next = (current - y + img.rows) % img.rows;
+		}
+	}
+}
 
 // Performes a circular shift in (dx,dy) direction
 /*
@@ -17,60 +51,63 @@ return   :  circular shifted matrix
 */
 Mat Dip4::circShift(const Mat &in, int dx, int dy)
 {
-	/*Cut source image into 4 parts (if dx > 0 & dy > 0)
-	0,0-----------------------------cols-1,0
-	-			      -			     	-
-	-		 0	      -		   1     	-
-    -				  -			     	-
-	-				  -			     	-
-	----------cols-dx,rows-dy(in 3)-----cols-1,rows-dy
-	-				  -			     	-
-	-		 2		  -		   3     	-
-	-				  -			     	-
-	-				  -			     	-	
-	----------cols-dx,rows-1------cols-1,rows-1
-
-	Cut result image into 4 parts
-	0,0------------dx-1,0----------cols-1,0
-	-			      -			     	-
-	-		 3		  -		   2     	-
-    -				  -			     	-
-	-				  -			     	-
-	0,dy-1----dx-1,dy-1(in 3)------------
-	-				  -			     	-
-	-		 1		  -		   0     	-
-	-				  -			     	-
-	-				  -			     	-	
-	-------------------------------------*/
-	Mat dst(in.size(), CV_32FC1);
-	int x, y;
-	// Adjust parameters
-	if (dx == 0 && dy == 0)
-		return in;
-	if (dx >= 0)
-		x = dx % in.cols;
-	else
-		x = dx % in.cols + in.cols;
-	if (dy >= 0)
-		y = dy % in.rows;
-	else
-		y = dy % in.rows + in.rows;
-
-	Mat tmp0, tmp1, tmp2, tmp3;
-	Mat part0(in, Rect(0, 0, in.cols - x, in.rows - y));
-	Mat part1(in, Rect(in.cols - x, 0, x, in.rows - y));
-	Mat part2(in, Rect(0, in.rows - y, in.cols - x, y));
-	Mat part3(in, Rect(in.cols - x, in.rows - y, x, y));
-	part0.copyTo(tmp0);
-	part1.copyTo(tmp1);
-	part2.copyTo(tmp2);
-	part3.copyTo(tmp3);
-	tmp0.copyTo(in(Rect(x, y, in.cols - x, in.rows - y)));
-	tmp1.copyTo(in(Rect(0, y, x, in.rows - y)));
-	tmp2.copyTo(in(Rect(x, 0, in.cols - x, y)));
-	tmp3.copyTo(in(Rect(0, 0, x, y)));
-
-	return in;
+	Mat dst(in.size(), in.type());
+	circShift(in, dst, dx, dy);
+	return dst;
+}
+
+// Performes a circular shift in (dx,dy) direction into a destination buffer
+// dst may be larger than in, i.e. zero padding (by the caller) and shift are done in one step
+// the parts of dst not covered by in are left untouched
+/*
+in       :  input matrix
+dst      :  output matrix, at least the size of in and of the same type, must not overlap in
+dx       :  shift in x-direction, modulo the width of dst
+dy       :  shift in y-direction, modulo the height of dst
+*/
+void Dip4::circShift(const Mat &in, Mat &dst, int dx, int dy)
+{
+	CV_Assert(in.type() == dst.type() && in.rows <= dst.rows && in.cols <= dst.cols);
+	int x = (dx % dst.cols + dst.cols) % dst.cols;
+	int y = (dy % dst.rows + dst.rows) % dst.rows;
+
+	// in is cut into up to 4 parts: the part that stays in place and the parts wrapping around the right and bottom border
+	int cols = std::min(in.cols, dst.cols - x);
+	int rows = std::min(in.rows, dst.rows - y);
+	in(Rect(0, 0, cols, rows)).copyTo(dst(Rect(x, y, cols, rows)));
+	if (cols < in.cols)
+		in(Rect(cols, 0, in.cols - cols, rows)).copyTo(dst(Rect(0, y, in.cols - cols, rows)));
+	if (rows < in.rows)
+		in(Rect(0, rows, cols, in.rows - rows)).copyTo(dst(Rect(x, 0, cols, in.rows - rows)));
+	if (cols < in.cols && rows < in.rows)
+		in(Rect(cols, rows, in.cols - cols, in.rows - rows)).copyTo(dst(Rect(0, 0, in.cols - cols, in.rows - rows)));
+}
+
+// Performes a circular shift in (dx,dy) direction in place, without temporary images
+// the half-size shift of even sized images (fftshift) swaps the quadrants in one pass
+/*
+img      :  matrix to shift
+dx       :  shift in x-direction
+dy       :  shift in y-direction
+*/
+void Dip4::circShiftInPlace(Mat &img, int dx, int dy)
+{
+	int x = (dx % img.cols + img.cols) % img.cols;
+	int y = (dy % img.rows + img.rows) % img.rows;
+
+	if (img.cols % 2 == 0 && img.rows % 2 == 0 && x == img.cols / 2 && y == img.rows / 2)
+	{
+		swapBlocks(img(Rect(0, 0, x, y)), img(Rect(x, y, x, y)));
+		swapBlocks(img(Rect(x, 0, x, y)), img(Rect(0, y, x, y)));
+		return;
+	}
+
+	rotateRows(img, y);
+	if (x == 0)
+		return;
+	size_t bytes = img.cols * img.elemSize(), shift = (img.cols - x) * img.elemSize();
+	for (int i = 0; i < img.rows; i++)
+		std::rotate(img.ptr(i), img.ptr(i) + shift, img.ptr(i) + bytes);
 }
 
 // Function applies the inverse filter to restorate a degraded image
@@ -81,11 +118,9 @@ return   :  restorated output image
 */
 Mat Dip4::inverseFilter(const Mat &degraded, const Mat &filter)
 {
-	//copy filter to larger template
+	//copy filter to larger template, centred at the origin
 	Mat big_filter = Mat::zeros(degraded.size(), CV_32FC1);
-	Mat mask = big_filter(Rect(0, 0, filter.cols, filter.rows));
-	filter.copyTo(mask);
-	big_filter = circShift(big_filter.clone(), -1 * int(filter.cols / 2), -1 * int(filter.rows / 2));
+	circShift(filter, big_filter, -1 * int(filter.cols / 2), -1 * int(filter.rows / 2));
 
 	//pad zero to the second channel
 	Mat big_filter_pad, img_pad;
@@ -161,11 +196,9 @@ return   :   restorated output image
 */
 Mat Dip4::wienerFilter(const Mat &degraded, const Mat &filter, double snr)
 {
-	//copy filter to larger template
+	//copy filter to larger template, centred at the origin
 	Mat big_filter = Mat::zeros(degraded.size(), CV_32FC1);
-	Mat mask = big_filter(Rect(0, 0, filter.cols, filter.rows));
-	filter.copyTo(mask);
-	big_filter = circShift(big_filter.clone(), -1 * int(filter.cols / 2), -1 * int(filter.rows / 2));
+	circShift(filter, big_filter, -1 * int(filter.cols / 2), -1 * int(filter.rows / 2));
 
 	//pad zero to the second channel
 	Mat big_filter_pad, img_pad;
@@ -334,5 +367,30 @@ void Dip4::test_circShift(void)
 		cout << "ERROR: Dip4::circShift(): Result of circshift seems to be wrong!" << endl;
 		return;
 	}
+
+	// in place and into a larger buffer, the second shift is the half-size (fftshift) case
+	Mat image(6, 8, CV_32FC1);
+	randu(image, 0, 1);
+	int shifts[4][2] = {{3, 2}, {4, 3}, {-5, 7}, {0, -4}};
+	for (int s = 0; s < 4; s++)
+	{
+		int dx = shifts[s][0], dy = shifts[s][1];
+		Mat shifted = image.clone();
+		Mat padded = Mat::zeros(9, 11, CV_32FC1);
+		circShiftInPlace(shifted, dx, dy);
+		circShift(image, padded, dx, dy);
+		for (int y = 0; y < image.rows; y++)
+		{
+			for (int x = 0; x < image.cols; x++)
+			{
+				if (shifted.at<float>(((y + dy) % 6 + 6) % 6, ((x + dx) % 8 + 8) % 8) != image.at<float>(y, x) or
+					padded.at<float>(((y + dy) % 9 + 9) % 9, ((x + dx) % 11 + 11) % 11) != image.at<float>(y, x))
+				{
+					cout << "ERROR: Dip4::circShift(): Result of in place or padded circshift seems to be wrong!" << endl;
+					return;
+				}
+			}
+		}
+	}
 	cout << "Message: Dip4::circShift() seems to be correct" << endl;
 }
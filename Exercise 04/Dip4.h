@@ -39,6 +39,8 @@ class Dip4{
       // function headers of functions implemented in previous exercises
       // --> re-use your (corrected) code
       Mat circShift(const Mat& in, int dx, int dy);
+      void circShift(const Mat& in, Mat& dst, int dx, int dy);
+      void circShiftInPlace(Mat& img, int dx, int dy);
       Mat frequencyConvolution(const Mat& in, const Mat& kernel);
     
       // testing routines
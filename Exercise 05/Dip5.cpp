@@ -18,8 +18,9 @@ void Dip5::getInterestPoints(const Mat &img, double sigma, vector<KeyPoint> &poi
 	y_kernel = y_kernel.t();
 
 	//Gx, Gy, Gx_sq, Gy_sq, Gx_Gy
-	filter2D(img, Gx, -1, x_kernel);
-	filter2D(img, Gy, -1, y_kernel);
+	//the gradients are float for any input depth (e.g. 8-bit images are read directly)
+	filter2D(img, Gx, CV_32F, x_kernel);
+	filter2D(img, Gy, CV_32F, y_kernel);
 
 	Gx_sq = Gx.mul(Gx);
 	Gy_sq = Gy.mul(Gy);
@@ -33,8 +33,6 @@ int main(int argc, char** argv) {
       cin.get();
       return -1;
    }
-   // convert U8 to 32F
-   img.convertTo(img, CV_32FC1);
    cout << " > done" << endl;
 
    // define standard deviation of directional gradient
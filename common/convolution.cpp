@@ -0,0 +1,458 @@
+//============================================================================
+// Name        : convolution.cpp
+// Description : spatial convolution engines shared by the exercises
+//============================================================================
+
+#include "convolution.h"
+#include <climits>
+#include <map>
+#include <mutex>
+
+// convolution engines
+// every engine convolves a block of output rows with an already flipped kernel
+// the source is padded by (kernel.rows - 1) / 2 rows and (kernel.cols - 1) / 2 columns on every side
+// vector engines process several output columns per instruction and several output rows per pass,
+// so every loaded source vector is used for all rows of the block
+
+// scalar convolution of one output row, columns [col0, col1)
+/*
+padded:  padded source image
+kernel:  flipped filter kernel (continuous)
+dst:     output image
+row:     output row
+*/
+static void convolvePixels(const Mat &padded, const Mat &kernel, Mat &dst, int row, int col0, int col1)
+{
+	const float *kernel_data = kernel.ptr<float>(0);
+	float *dst_data = dst.ptr<float>(row);
+	for (int j = col0; j < col1; j++)
+	{
+		float temp = 0;
+		for (int m = 0; m < kernel.rows; m++)
+		{
+			const float *data = padded.ptr<float>(row + m) + j;
+			const float *kernel_flipped_data = kernel_data + m * kernel.cols;
+			for (int n = 0; n < kernel.cols; n++)
+				temp += data[n] * kernel_flipped_data[n];
+		}
+		dst_data[j] = temp;
+	}
+}
+
+template <int ROWS>
+static void convolveRowsScalar(const Mat &padded, const Mat &kernel, Mat &dst, int row0)
+{
+	for (int q = 0; q < ROWS; q++)
+		convolvePixels(padded, kernel, dst, row0 + q, 0, dst.cols);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CONVOLUTION_X86_ENGINES
+// vectors are only passed between functions compiled for the same instruction set
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// 4 floats per vector, separate multiply and add
+template <int ROWS>
+__attribute__((target("sse4.1"))) static void convolveRowsSSE4(const Mat &padded, const Mat &kernel, Mat &dst, int row0)
+{
+	const float *kernel_data = kernel.ptr<float>(0);
+	int kRows = kernel.rows, kCols = kernel.cols;
+	int j = 0;
+	for (; j <= dst.cols - 4; j += 4)
+	{
+		__m128 acc[ROWS];
+		for (int q = 0; q < ROWS; q++)
+			acc[q] = _mm_setzero_ps();
+		// source row s contributes to output row q with kernel row s - q
+		for (int s = 0; s < kRows + ROWS - 1; s++)
+		{
+			const float *data = padded.ptr<float>(row0 + s) + j;
+			for (int n = 0; n < kCols; n++)
+			{
+				__m128 v = _mm_loadu_ps(data + n);
+				for (int q = 0; q < ROWS; q++)
+				{
+					if (s - q < 0 || s - q >= kRows)
+						continue;
+					acc[q] = _mm_add_ps(acc[q], _mm_mul_ps(v, _mm_set1_ps(kernel_data[(s - q) * kCols + n])));
+				}
+			}
+		}
+		for (int q = 0; q < ROWS; q++)
+			_mm_storeu_ps(dst.ptr<float>(row0 + q) + j, acc[q]);
+	}
+	for (int q = 0; q < ROWS; q++)
+		convolvePixels(padded, kernel, dst, row0 + q, j, dst.cols);
+}
+
+// 8 floats per vector, fused multiply-add
+template <int ROWS>
+__attribute__((target("avx2,fma"))) static void convolveRowsAVX2(const Mat &padded, const Mat &kernel, Mat &dst, int row0)
+{
+	const float *kernel_data = kernel.ptr<float>(0);
+	int kRows = kernel.rows, kCols = kernel.cols;
+	int j = 0;
+	for (; j <= dst.cols - 8; j += 8)
+	{
+		__m256 acc[ROWS];
+		for (int q = 0; q < ROWS; q++)
+			acc[q] = _mm256_setzero_ps();
+		for (int s = 0; s < kRows + ROWS - 1; s++)
+		{
+			const float *data = padded.ptr<float>(row0 + s) + j;
+			for (int n = 0; n < kCols; n++)
+			{
+				__m256 v = _mm256_loadu_ps(data + n);
+				for (int q = 0; q < ROWS; q++)
+				{
+					if (s - q < 0 || s - q >= kRows)
+						continue;
+					acc[q] = _mm256_fmadd_ps(v, _mm256_set1_ps(kernel_data[(s - q) * kCols + n]), acc[q]);
+				}
+			}
+		}
+		for (int q = 0; q < ROWS; q++)
+			_mm256_storeu_ps(dst.ptr<float>(row0 + q) + j, acc[q]);
+	}
+	for (int q = 0; q < ROWS; q++)
+		convolvePixels(padded, kernel, dst, row0 + q, j, dst.cols);
+}
+#endif
+
+// number of output rows per pass of the vector engines
+static const int CONV_BLOCK_ROWS = 4;
+
+static const ConvolutionEngine ENGINE_SCALAR = {"scalar", convolveRowsScalar<CONV_BLOCK_ROWS>, convolveRowsScalar<1>};
+#ifdef CONVOLUTION_X86_ENGINES
+static const ConvolutionEngine ENGINE_SSE4 = {"sse4", convolveRowsSSE4<CONV_BLOCK_ROWS>, convolveRowsSSE4<1>};
+static const ConvolutionEngine ENGINE_AVX2 = {"avx2", convolveRowsAVX2<CONV_BLOCK_ROWS>, convolveRowsAVX2<1>};
+#endif
+
+// all engines supported by this CPU, fastest first
+vector<const ConvolutionEngine *> convolutionEngines(void)
+{
+	vector<const ConvolutionEngine *> engines;
+#ifdef CONVOLUTION_X86_ENGINES
+	if (checkHardwareSupport(CV_CPU_AVX2) && checkHardwareSupport(CV_CPU_FMA3))
+		engines.push_back(&ENGINE_AVX2);
+	if (checkHardwareSupport(CV_CPU_SSE4_1))
+		engines.push_back(&ENGINE_SSE4);
+#endif
+	engines.push_back(&ENGINE_SCALAR);
+	return engines;
+}
+
+// the fastest engine of this CPU, chosen once at runtime
+const ConvolutionEngine &convolutionEngine(void)
+{
+	static const ConvolutionEngine *engine = convolutionEngines().front();
+	return *engine;
+}
+
+// convolves a padded image with a flipped kernel
+/*
+padded:  source image, padded by half the kernel size on every side
+kernel:  flipped filter kernel (continuous)
+dst:     output image, size of the unpadded source
+engine:  convolution engine
+*/
+void convolve2D(const Mat &padded, const Mat &kernel, Mat &dst, const ConvolutionEngine &engine)
+{
+	int i = 0;
+	for (; i <= dst.rows - CONV_BLOCK_ROWS; i += CONV_BLOCK_ROWS)
+		engine.block(padded, kernel, dst, i);
+	for (; i < dst.rows; i++)
+		engine.row(padded, kernel, dst, i);
+}
+
+// singular values below this fraction of the largest one are treated as zero
+static const double KERNEL_RANK_EPS = 1e-5;
+// maximal number of decomposed kernels kept in the cache
+static const size_t KERNEL_CACHE_SIZE = 64;
+
+// decomposes a kernel by singular value decomposition
+/*
+kernel:  filter kernel
+return:  the separable terms of the kernel, one for every non-zero singular value
+*/
+static SeparableKernel decomposeKernel(const Mat &kernel)
+{
+	SeparableKernel decomposition;
+	Mat kernel64, w, u, vt;
+	kernel.convertTo(kernel64, CV_64F);
+	SVD::compute(kernel64, w, u, vt);
+
+	int rank = 0;
+	while (rank < w.rows && w.at<double>(rank) > w.at<double>(0) * KERNEL_RANK_EPS)
+		rank++;
+	// rank passes with kernel.rows + kernel.cols taps each vs. one pass with kernel.rows * kernel.cols taps
+	decomposition.separable = rank * (kernel.rows + kernel.cols) < kernel.rows * kernel.cols;
+	if (!decomposition.separable)
+		return decomposition;
+
+	for (int k = 0; k < rank; k++)
+	{
+		double scale = std::sqrt(w.at<double>(k));
+		Mat column, row;
+		Mat(u.col(k) * scale).convertTo(column, CV_32F);
+		Mat(vt.row(k) * scale).convertTo(row, CV_32F);
+		decomposition.columns.push_back(column);
+		decomposition.rows.push_back(row);
+	}
+	return decomposition;
+}
+
+// returns the decomposition of a kernel, every kernel is decomposed only once
+/*
+kernel:  filter kernel (continuous)
+return:  the separable terms of the kernel
+*/
+SeparableKernel separableKernel(const Mat &kernel)
+{
+	static std::map<string, SeparableKernel> cache;
+	static std::mutex cacheMutex;
+
+	// kernels are identified by size and contents
+	string key((const char *)kernel.ptr(0), kernel.total() * kernel.elemSize());
+	key += to_string(kernel.rows) + "x" + to_string(kernel.cols);
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	std::map<string, SeparableKernel>::iterator entry = cache.find(key);
+	if (entry != cache.end())
+		return entry->second;
+	if (cache.size() >= KERNEL_CACHE_SIZE)
+		cache.clear();
+	SeparableKernel decomposition = decomposeKernel(kernel);
+	cache[key] = decomposition;
+	return decomposition;
+}
+
+// convolves a padded image with a kernel given as sum of separable kernels
+// every term is a vertical pass over the padded rows followed by a horizontal pass
+/*
+padded:     source image, padded by half the kernel size on every side
+separable:  decomposition of the flipped kernel
+dst:        output image, size of the unpadded source
+engine:     convolution engine
+*/
+void convolveSeparable(const Mat &padded, const SeparableKernel &separable, Mat &dst, const ConvolutionEngine &engine)
+{
+	Mat tmp(dst.rows, padded.cols, CV_32FC1);
+	Mat term(dst.size(), CV_32FC1);
+	dst.setTo(0);
+	for (size_t k = 0; k < separable.columns.size(); k++)
+	{
+		convolve2D(padded, separable.columns[k], tmp, engine);
+		convolve2D(tmp, separable.rows[k], k == 0 ? dst : term, engine);
+		if (k > 0)
+			dst += term;
+	}
+}
+
+// fixed-point convolution of 8-bit and 16-bit images
+// the kernel is quantized to Q15 (weight * 2^15, rounded) and the products are summed up in 32 bit integers
+// kernels whose absolute sum could overflow the sum for the largest source value keep fewer fraction bits
+// (16-bit values: every weight is off by up to 2^-16, i.e. up to half a step per tap)
+// integer results are rounded half up and saturated, e.g. negative values become 0 for unsigned output
+
+// fraction bits of the quantized kernel
+static const int FIXED_FRACTION_BITS = 15;
+
+// quantizes a kernel so the convolution of values up to maxValue cannot overflow 32 bits
+/*
+kernel:    flipped filter kernel
+maxValue:  largest source value
+return:    quantized kernel
+*/
+FixedKernel fixedKernel(const Mat &kernel, double maxValue)
+{
+	FixedKernel fixed;
+	fixed.rows = kernel.rows;
+	fixed.cols = kernel.cols;
+	Mat kernel64;
+	kernel.convertTo(kernel64, CV_64F);
+	double absSum = norm(kernel64, NORM_L1);
+	// every weight is rounded by up to 0.5, the rounding offset adds 2^(shift - 1)
+	fixed.shift = FIXED_FRACTION_BITS;
+	while (fixed.shift > 0 && (absSum * (1 << fixed.shift) + kernel.total()) * maxValue + (1 << fixed.shift) > INT_MAX)
+		fixed.shift--;
+	// the rounding error of the weights is moved to the largest one, so the weights keep their sum
+	// (e.g. a smoothing kernel does not change the brightness)
+	int quantizedSum = 0;
+	size_t largest = 0;
+	for (int m = 0; m < kernel.rows; m++)
+	{
+		for (int n = 0; n < kernel.cols; n++)
+		{
+			fixed.weights.push_back(cvRound(kernel64.at<double>(m, n) * (1 << fixed.shift)));
+			quantizedSum += fixed.weights.back();
+			if (std::abs(fixed.weights.back()) > std::abs(fixed.weights[largest]))
+				largest = fixed.weights.size() - 1;
+		}
+	}
+	fixed.weights[largest] += cvRound(sum(kernel64).val[0] * (1 << fixed.shift)) - quantizedSum;
+	return fixed;
+}
+
+// writes one row of fixed-point sums
+/*
+sum:    sums of the products, fraction bits as the kernel
+cols:   number of columns
+shift:  fraction bits
+dst:    output row
+*/
+static inline void storeFixed(const int *sum, int cols, int shift, float *dst)
+{
+	float scale = 1.f / (1 << shift);
+	for (int j = 0; j < cols; j++)
+		dst[j] = sum[j] * scale;
+}
+
+template <typename DstT>
+static inline void storeFixed(const int *sum, int cols, int shift, DstT *dst)
+{
+	int half = (1 << shift) >> 1;
+	for (int j = 0; j < cols; j++)
+		dst[j] = saturate_cast<DstT>((sum[j] + half) >> shift);
+}
+
+// adds the products of one kernel tap to the sums of one output row: sum[j] += weight * src[j]
+template <typename SrcT>
+static void accumulateTapScalar(int *sum, const SrcT *src, int weight, int cols)
+{
+	for (int j = 0; j < cols; j++)
+		sum[j] += weight * src[j];
+}
+
+#ifdef CONVOLUTION_X86_ENGINES
+// 8 source values widened to 32 bit integers
+__attribute__((target("avx2"))) static inline __m256i loadWidened(const uchar *src)
+{
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src));
+}
+
+__attribute__((target("avx2"))) static inline __m256i loadWidened(const ushort *src)
+{
+	return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)src));
+}
+
+__attribute__((target("avx2"))) static inline __m256i loadWidened(const int *src)
+{
+	return _mm256_loadu_si256((const __m256i *)src);
+}
+
+// 8 sums per vector
+template <typename SrcT>
+__attribute__((target("avx2"))) static void accumulateTapAVX2(int *sum, const SrcT *src, int weight, int cols)
+{
+	__m256i w = _mm256_set1_epi32(weight);
+	int j = 0;
+	for (; j <= cols - 8; j += 8)
+	{
+		__m256i acc = _mm256_loadu_si256((const __m256i *)(sum + j));
+		acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(loadWidened(src + j), w));
+		_mm256_storeu_si256((__m256i *)(sum + j), acc);
+	}
+	for (; j < cols; j++)
+		sum[j] += weight * src[j];
+}
+#endif
+
+template <typename SrcT>
+using AccumulateTap = void (*)(int *, const SrcT *, int, int);
+
+// the tap accumulation used by the fixed-point convolution, chosen once at runtime
+template <typename SrcT>
+static AccumulateTap<SrcT> accumulateTap(void)
+{
+#ifdef CONVOLUTION_X86_ENGINES
+	static AccumulateTap<SrcT> tap = checkHardwareSupport(CV_CPU_AVX2) ? accumulateTapAVX2<SrcT> : accumulateTapScalar<SrcT>;
+	return tap;
+#else
+	return accumulateTapScalar<SrcT>;
+#endif
+}
+
+// fixed-point convolution, the sums of one output row are accumulated tap by tap
+// sums are rounded to the output as they are, or after dropping extra fraction bits (outShift > kernel.shift)
+/*
+padded:    source image (SrcT), padded by half the kernel size on every side
+kernel:    quantized flipped kernel
+dst:       output image (DstT), size of the unpadded source
+outShift:  fraction bits of the sums
+*/
+template <typename SrcT, typename DstT>
+static void convolveFixed(const Mat &padded, const FixedKernel &kernel, Mat &dst, int outShift)
+{
+	AccumulateTap<SrcT> tap = accumulateTap<SrcT>();
+	vector<int> sum(dst.cols);
+	for (int i = 0; i < dst.rows; i++)
+	{
+		std::fill(sum.begin(), sum.end(), 0);
+		for (int m = 0; m < kernel.rows; m++)
+		{
+			for (int n = 0; n < kernel.cols; n++)
+			{
+				int weight = kernel.weights[m * kernel.cols + n];
+				if (weight != 0)
+					tap(&sum[0], padded.ptr<SrcT>(i + m) + n, weight, dst.cols);
+			}
+		}
+		storeFixed(&sum[0], dst.cols, outShift, dst.ptr<DstT>(i));
+	}
+}
+
+// fixed-point convolution into an output of any supported depth
+template <typename SrcT>
+void convolveFixedDepth(const Mat &padded, const FixedKernel &kernel, Mat &dst, int outShift)
+{
+	switch (dst.depth())
+	{
+	case CV_8U:
+		convolveFixed<SrcT, uchar>(padded, kernel, dst, outShift);
+		break;
+	case CV_16U:
+		convolveFixed<SrcT, ushort>(padded, kernel, dst, outShift);
+		break;
+	case CV_16S:
+		convolveFixed<SrcT, short>(padded, kernel, dst, outShift);
+		break;
+	default:
+		convolveFixed<SrcT, float>(padded, kernel, dst, outShift);
+	}
+}
+
+// fixed-point convolution with a separable kernel (column * row)
+// the vertical pass keeps some fraction bits in its 32 bit result, as many as fit into 16 bit magnitude,
+// so the horizontal pass can use (almost) Q15 weights as well
+/*
+padded:    source image (SrcT), padded by half the kernel size on every side
+column:    flipped column kernel
+row:       flipped row kernel
+maxValue:  largest source value
+dst:       output image, size of the unpadded source
+*/
+template <typename SrcT>
+void convolveFixedSeparable(const Mat &padded, const Mat &column, const Mat &row, double maxValue, Mat &dst)
+{
+	FixedKernel fixedColumn = fixedKernel(column, maxValue);
+	double columnMax = 0; // largest magnitude of the vertical sums, weights / 2^shift
+	for (size_t k = 0; k < fixedColumn.weights.size(); k++)
+		columnMax += std::abs(fixedColumn.weights[k]) * maxValue / (1 << fixedColumn.shift);
+	int extraBits = 0;
+	while (extraBits < fixedColumn.shift && columnMax * (2 << extraBits) <= 65535)
+		extraBits++;
+	// + 1 for rounding
+	FixedKernel fixedRow = fixedKernel(row, columnMax * (1 << extraBits) + 1);
+
+	Mat tmp(dst.rows, padded.cols, CV_32SC1);
+	convolveFixed<SrcT, int>(padded, fixedColumn, tmp, fixedColumn.shift - extraBits);
+	convolveFixedDepth<int>(tmp, fixedRow, dst, fixedRow.shift + extraBits);
+}
+
+// 8-bit and 16-bit sources, int for the second pass of the separable convolution
+template void convolveFixedDepth<uchar>(const Mat &, const FixedKernel &, Mat &, int);
+template void convolveFixedDepth<ushort>(const Mat &, const FixedKernel &, Mat &, int);
+template void convolveFixedSeparable<uchar>(const Mat &, const Mat &, const Mat &, double, Mat &);
+template void convolveFixedSeparable<ushort>(const Mat &, const Mat &, const Mat &, double, Mat &);
@@ -0,0 +1,62 @@
+//============================================================================
+// Name        : convolution.h
+// Description : spatial convolution engines shared by the exercises
+//============================================================================
+
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+// convolution of output rows row0, row0 + 1, ... of a padded image with a flipped kernel
+typedef void (*ConvolveRows)(const Mat &, const Mat &, Mat &, int);
+// a set of row convolutions for one instruction set
+struct ConvolutionEngine
+{
+	const char *name;
+	ConvolveRows block; // a block of output rows
+	ConvolveRows row;   // a single output row
+};
+
+// all engines supported by this CPU, fastest first
+vector<const ConvolutionEngine *> convolutionEngines(void);
+// the fastest engine of this CPU, chosen once at runtime
+const ConvolutionEngine &convolutionEngine(void);
+// convolves a padded image with a flipped kernel (CV_32FC1)
+void convolve2D(const Mat &padded, const Mat &kernel, Mat &dst, const ConvolutionEngine &engine);
+
+// decomposition of a kernel into a sum of separable kernels: kernel = sum_k columns[k] * rows[k]
+struct SeparableKernel
+{
+	bool separable;      // false if the 2D convolution is cheaper
+	vector<Mat> columns; // kernel.rows x 1
+	vector<Mat> rows;    // 1 x kernel.cols
+};
+
+// decomposition of a kernel, every kernel is decomposed only once
+SeparableKernel separableKernel(const Mat &kernel);
+// convolves a padded image with a kernel given as sum of separable kernels (CV_32FC1)
+void convolveSeparable(const Mat &padded, const SeparableKernel &separable, Mat &dst, const ConvolutionEngine &engine);
+
+// kernel quantized to fixed point
+struct FixedKernel
+{
+	int rows, cols;
+	vector<int> weights; // row-major
+	int shift;           // fraction bits: kernel = weights / 2^shift
+};
+
+// quantizes a kernel so the convolution of values up to maxValue cannot overflow 32 bits
+FixedKernel fixedKernel(const Mat &kernel, double maxValue);
+// fixed-point convolution of a padded image (SrcT: uchar or ushort) into an output of any supported depth
+template <typename SrcT>
+void convolveFixedDepth(const Mat &padded, const FixedKernel &kernel, Mat &dst, int outShift);
+// fixed-point convolution of a padded image (SrcT: uchar or ushort) with a separable kernel (column * row)
+template <typename SrcT>
+void convolveFixedSeparable(const Mat &padded, const Mat &column, const Mat &row, double maxValue, Mat &dst);
+
+#endif